@@ -11,12 +11,15 @@ void panic(char *);
 // blk.c
 void blkinit(void);
 void blkrw(struct buf *b);
+void blkrwn(xvblk_t blockno, char *addr, Int count, Int write);
 
 // bio.c
 void binit(void);
 struct buf *bread(xvblk_t);
 void brelse(struct buf *);
 void bwrite(struct buf *);
+void breadn(xvblk_t, char *, Int);
+void bwriten(xvblk_t, char *, Int);
 
 // cprintf.c
 #ifndef CPRINTF_REDEFINED
@@ -68,6 +71,8 @@ int romgetputc(void);
 int ch375init(void);
 int readblock(unsigned char *buf, long lba);
 int writeblock(unsigned char *buf, long lba);
+int readblocks(unsigned char *buf, long lba, int count);
+int writeblocks(unsigned char *buf, long lba, int count);
 void jmptouser(Int memsize, Int argc, char *destbuf);
 void set_errno(Int);
 
@@ -26,8 +26,6 @@
 #include <errno.h>
 #include <arpa/inet.h>
 
-struct watchpoint *watchhead= NULL;
-
 unsigned X, Y, S, U, cPC;	// PC now cPC as conflicts with a library fn
 unsigned A, B, DP;
 unsigned H, N, Z, V, C;
@@ -40,6 +38,7 @@ int cpu_clk = 0;
 int cpu_period = 0;
 int cpu_quit = 1;
 int doing_sync=0;		// If 1, doing a SYNC instruction
+unsigned store_count=0;		// Stores and I/O reads, for idle detection
 
 int romaddr= 0x8000;		// Address from here up are ROM addresses.
 				// MMU09 has 32K of ROM starting here.
@@ -47,6 +46,7 @@ int romaddr= 0x8000;		// Address from here up are ROM addresses.
 unsigned *index_regs[4] = { &X, &Y, &U, &S };
 
 extern FILE *debugout;
+extern long long total;
 // Print out a called address and some of the stack as debug output
 void printcall(char *how) {
   unsigned stk= S;
@@ -58,32 +58,28 @@ void printcall(char *how) {
   }
 }
 
-unsigned imm_byte (void)
-{
-  unsigned val = memory(cPC & 0xffff); cPC++;
-  return val;
-}
-
-unsigned imm_word (void)
-{
-  unsigned val = (memory(cPC & 0xffff) << 8) | memory((cPC + 1) & 0xffff); cPC += 2; 
-  return val;
-}
-
 static void WRMEM (unsigned addr, unsigned data)
 {
-  struct watchpoint *this;
+  struct pagedesc *p = &pdt[addr >> 8];
+  int phys;
 
-  // Write the data to memory
-  set_memory(addr, (UINT8)data);
+  store_count++;
 
   // Fall into the monitor if we are writing to a watchpoint
-  if (watchhead != NULL) {
-    for (this= watchhead; this!= NULL; this=this->next)
-      if (this->addr == addr) {
-        printf("\nWatchpoint $%04X: $%02X\n", addr, data);
-	monitor_on = 1;
-      }
+  if ((p->flags & PD_WWATCH) && BITTEST(wwatch, addr)) {
+    printf("\nWatchpoint $%04X: $%02X\n", addr, data);
+    monitor_on = 1;
+  }
+
+  // Write the data to memory. Plain RAM is written directly,
+  // losing any decoded instruction which used the old byte.
+  if (p->flags & PD_NOWRITE) {
+    if (p->flags & PD_INVALID) page_fault(addr, PF_WRITE);
+    set_memory(addr, (UINT8)data);
+  } else {
+    p->ptr[addr & 0xff] = data;
+    phys = p->phys + (addr & 0xff);
+    if (is_code[phys]) icache_invalidate(phys);
   }
 }
 
@@ -94,17 +90,53 @@ void WRMEM16 (unsigned addr, unsigned data)
   WRMEM((addr + 1) & 0xffff,data & 0xff);
 }
 
-unsigned RDMEM (unsigned addr)
+/* Reads from I/O, invalid pages and pages with read watchpoints */
+static unsigned RDMEM_SLOW (unsigned addr)
 {
-  return(memory(addr));
+  unsigned val = memory(addr);
+
+  if (pdt[addr >> 8].flags & PD_INVALID) page_fault(addr, PF_READ);
+
+  store_count++;			// An I/O read can change things
+
+  // Fall into the monitor if we are reading a watchpoint
+  if ((pdt[addr >> 8].flags & PD_RWATCH) && BITTEST(rwatch, addr)) {
+    printf("\nRead watchpoint $%04X: $%02X\n", addr, val);
+    monitor_on = 1;
+  }
+  return(val);
+}
+
+/* Plain RAM and ROM reads come straight from the page descriptor */
+static inline unsigned RDMEM (unsigned addr)
+{
+  struct pagedesc *p = &pdt[addr >> 8];
+
+  if (p->flags & (PD_NOREAD|PD_RWATCH)) return(RDMEM_SLOW(addr));
+  return(p->ptr[addr & 0xff]);
+}
+
+/* A 16-bit read where the cycle is already accounted for.
+   Do both bytes at once if they are on the same plain page. */
+static inline unsigned RDMEM16_NC (unsigned addr)
+{
+  struct pagedesc *p = &pdt[addr >> 8];
+  UINT8 *ptr;
+  unsigned val;
+
+  // Otherwise read the high byte first, in case this is an I/O location
+  if ((p->flags & (PD_NOREAD|PD_RWATCH)) || (addr & 0xff) == 0xff) {
+    val = RDMEM(addr) << 8;
+    return(val | RDMEM((addr + 1) & 0xffff));
+  }
+  ptr = &p->ptr[addr & 0xff];
+  return((ptr[0] << 8) | ptr[1]);
 }
 
 unsigned RDMEM16 (unsigned addr)
 {
-  unsigned val = RDMEM(addr) << 8;
   cpu_clk--;
-  val |= RDMEM((addr + 1) & 0xffff);
-  return val;
+  return(RDMEM16_NC(addr));
 }
 
 #define write_stack WRMEM
@@ -121,45 +153,41 @@ unsigned read_stack16 (unsigned addr)
   return (read_stack(addr) << 8) | read_stack((addr + 1) & 0xffff);
 }
 
-void direct (void)
-{
-  unsigned val = memory(cPC & 0xffff) | DP; cPC++;
-  ea = val;
-}
-
-void indexed (void) /* note take 1 extra cycle */
+/* Work out the effective address of an indexed instruction. The cycles
+   for the addressing mode have already been added in by decode_inst() */
+static void index_ea (struct dinst *d)
 {
-   unsigned post = imm_byte();
+   unsigned post = d->post;
    unsigned *R   = index_regs[(post >> 5) & 0x3];
  
    if (post & 0x80)
    {
      switch (post & 0x1f)
      {
-       case 0x00: ea = *R; *R = (*R + 1) & 0xffff;                  cpu_clk -= 6; break;
-       case 0x01: ea = *R; *R = (*R + 2) & 0xffff;                  cpu_clk -= 7; break;
-       case 0x02: *R = (*R - 1) & 0xffff; ea = *R;                  cpu_clk -= 6; break;
-       case 0x03: *R = (*R - 2) & 0xffff; ea = *R;                  cpu_clk -= 7; break;
-       case 0x04: ea = *R;                                          cpu_clk -= 4; break;
-       case 0x05: ea = (*R + ((INT8)B)) & 0xffff;                   cpu_clk -= 5; break;
-       case 0x06: ea = (*R + ((INT8)A)) & 0xffff;                   cpu_clk -= 5; break;
-       case 0x08: ea = (*R + ((INT8)imm_byte())) & 0xffff;          cpu_clk -= 5; break;
-       case 0x09: ea = (*R + imm_word()) & 0xffff;                  cpu_clk -= 8; break;
-       case 0x0b: ea = (*R + get_d()) & 0xffff;                     cpu_clk -= 8; break;
-       case 0x0c: ea = (INT8)imm_byte(); ea = (ea + cPC) & 0xffff;   cpu_clk -= 5; break; 
-       case 0x0d: ea = imm_word(); ea = (ea + cPC) & 0xffff;         cpu_clk -= 9; break;
-
-       case 0x11: ea = *R; *R = (*R + 2) & 0xffff;                  cpu_clk -= 7; ea = RDMEM16(ea); cpu_clk -= 2; break;
-       case 0x13: *R = (*R - 2) & 0xffff; ea = *R;                  cpu_clk -= 7; ea = RDMEM16(ea); cpu_clk -= 2; break;
-       case 0x14: ea = *R;                                          cpu_clk -= 4; ea = RDMEM16(ea); cpu_clk -= 2; break;
-       case 0x15: ea = (*R + ((INT8)B)) & 0xffff;                   cpu_clk -= 5; ea = RDMEM16(ea); cpu_clk -= 2; break;
-       case 0x16: ea = (*R + ((INT8)A)) & 0xffff;                   cpu_clk -= 5; ea = RDMEM16(ea); cpu_clk -= 2; break;
-       case 0x18: ea = (*R + ((INT8)imm_byte())) & 0xffff;          cpu_clk -= 5; ea = RDMEM16(ea); cpu_clk -= 2; break;
-       case 0x19: ea = (*R + imm_word()) & 0xffff;                  cpu_clk -= 8; ea = RDMEM16(ea); cpu_clk -= 2; break;
-       case 0x1b: ea = (*R + get_d()) & 0xffff;                     cpu_clk -= 8; ea = RDMEM16(ea); cpu_clk -= 2; break;
-       case 0x1c: ea = (INT8)imm_byte(); ea = (ea + cPC) & 0xffff;   cpu_clk -= 5; ea = RDMEM16(ea); cpu_clk -= 2; break;
-       case 0x1d: ea = imm_word(); ea = (ea + cPC) & 0xffff;         cpu_clk -= 9; ea = RDMEM16(ea); cpu_clk -= 2; break;
-       case 0x1f: ea = imm_word();                                  cpu_clk -= 6; ea = RDMEM16(ea); cpu_clk -= 2; break;      
+       case 0x00: ea = *R; *R = (*R + 1) & 0xffff;                  break;
+       case 0x01: ea = *R; *R = (*R + 2) & 0xffff;                  break;
+       case 0x02: *R = (*R - 1) & 0xffff; ea = *R;                  break;
+       case 0x03: *R = (*R - 2) & 0xffff; ea = *R;                  break;
+       case 0x04: ea = *R;                                          break;
+       case 0x05: ea = (*R + ((INT8)B)) & 0xffff;                   break;
+       case 0x06: ea = (*R + ((INT8)A)) & 0xffff;                   break;
+       case 0x08: ea = (*R + d->operand) & 0xffff;                  break;
+       case 0x09: ea = (*R + d->operand) & 0xffff;                  break;
+       case 0x0b: ea = (*R + get_d()) & 0xffff;                     break;
+       case 0x0c: ea = (d->operand + cPC) & 0xffff;                 break; 
+       case 0x0d: ea = (d->operand + cPC) & 0xffff;                 break;
+
+       case 0x11: ea = *R; *R = (*R + 2) & 0xffff;                  ea = RDMEM16_NC(ea); break;
+       case 0x13: *R = (*R - 2) & 0xffff; ea = *R;                  ea = RDMEM16_NC(ea); break;
+       case 0x14: ea = *R;                                          ea = RDMEM16_NC(ea); break;
+       case 0x15: ea = (*R + ((INT8)B)) & 0xffff;                   ea = RDMEM16_NC(ea); break;
+       case 0x16: ea = (*R + ((INT8)A)) & 0xffff;                   ea = RDMEM16_NC(ea); break;
+       case 0x18: ea = (*R + d->operand) & 0xffff;                  ea = RDMEM16_NC(ea); break;
+       case 0x19: ea = (*R + d->operand) & 0xffff;                  ea = RDMEM16_NC(ea); break;
+       case 0x1b: ea = (*R + get_d()) & 0xffff;                     ea = RDMEM16_NC(ea); break;
+       case 0x1c: ea = (d->operand + cPC) & 0xffff;                 ea = RDMEM16_NC(ea); break;
+       case 0x1d: ea = (d->operand + cPC) & 0xffff;                 ea = RDMEM16_NC(ea); break;
+       case 0x1f: ea = d->operand;                                  ea = RDMEM16_NC(ea); break;      
        default:   ea = 0;  printf("%X: invalid index post $%02X\n",iPC,post); monitor_on = 1;                     break;
      }
    }
@@ -167,16 +195,9 @@ void indexed (void) /* note take 1 extra cycle */
    {
      if( post & 0x10) post |= 0xfff0; else post &= 0x000f;
      ea = (*R + post) & 0xffff;
-     cpu_clk -= 5;
    }
 }
 
-void extended (void)
-{
-  unsigned val = (memory(cPC & 0xffff) << 8) | memory((cPC + 1) & 0xffff); cPC += 2; 
-  ea = val;
-}
-
 /* external register functions */
 
 unsigned get_a  (void) { return A; }
@@ -199,6 +220,85 @@ void set_u  (unsigned val) { U = val & 0xffff; }
 void set_pc (unsigned val) { cPC = val & 0xffff; }
 void set_d  (unsigned val) { A = (val >> 8) & 0xff; B = val & 0xff; }
 
+/* Lazy condition codes.
+
+   Nearly every instruction sets N, Z and V but few of them are
+   looked at before they are set again. So the ALU helpers only
+   record the kind of operation, its result and whatever operands
+   V needs, and the flags are worked out from these when a branch,
+   get_cc() or an interrupt needs them. When lz_op is LZ_NONE the
+   flags are in N, Z and V as usual. H and C are always set
+   directly, as adc, sbc, rol, ror and daa need them straight away.
+
+   Helpers which set only some of N, Z and V call flush_flags()
+   first, so that the others are kept. */
+
+enum
+{
+  LZ_NONE,
+  LZ_LOG8,	/* V = 0 */
+  LZ_ADD8,	/* lz_arg = arg ^ val */
+  LZ_SUB8,	/* lz_arg = arg ^ val, lz_val = arg */
+  LZ_INC8,	/* lz_arg = arg */
+  LZ_DEC8,	/* lz_arg = arg */
+  LZ_SHL8,	/* lz_arg = arg */
+  LZ_NEG8,	/* lz_arg = arg */
+  LZ_LOG16,	/* The 16-bit ones must come last */
+  LZ_ADD16,	/* lz_arg = arg, lz_val = val */
+  LZ_SUB16	/* lz_arg = arg ^ val, lz_val = arg */
+};
+
+static int lz_op = LZ_NONE;
+static unsigned lz_res, lz_arg, lz_val;
+
+#define LAZY(op, res)           (lz_op = (op), lz_res = (res))
+#define LAZY1(op, res, arg)     (lz_op = (op), lz_res = (res), lz_arg = (arg))
+#define LAZY2(op, res, arg, val) \
+	(lz_op = (op), lz_res = (res), lz_arg = (arg), lz_val = (val))
+
+static inline int flag_N (void)
+{
+  if (lz_op == LZ_NONE)  return ((N & 0x80) != 0);
+  if (lz_op >= LZ_LOG16) return ((lz_res & 0x8000) != 0);
+  return ((lz_res & 0x80) != 0);
+}
+
+static inline int flag_Z (void)
+{
+  if (lz_op == LZ_NONE) return (Z == 0);
+  return (lz_res == 0);
+}
+
+static inline int flag_V (void)
+{
+  unsigned v;
+
+  switch (lz_op)
+  {
+    case LZ_NONE:  v = V;                                             break;
+    case LZ_ADD8:  v = lz_arg ^ lz_res ^ (C != 0 ? 0x80 : 0);          break;
+    case LZ_SUB8:  v = lz_arg & (lz_val ^ lz_res);                    break;
+    case LZ_INC8:  v = ~lz_arg & lz_res;                              break;
+    case LZ_DEC8:  v = lz_arg & ~lz_res;                              break;
+    case LZ_SHL8:  v = lz_arg ^ lz_res;                               break;
+    case LZ_NEG8:  v = lz_arg & lz_res;                               break;
+    case LZ_ADD16: v = ((lz_arg ^ lz_res) & (lz_val ^ lz_res)) >> 8;  break;
+    case LZ_SUB16: v = (lz_arg & (lz_val ^ lz_res)) >> 8;             break;
+    default:       v = 0;                                             break;
+  }
+  return ((v & 0x80) != 0);
+}
+
+/* Put N, Z and V back into their variables */
+static void flush_flags (void)
+{
+  if (lz_op == LZ_NONE) return;
+  N = flag_N() ? 0x80 : 0;
+  Z = flag_Z() ? 0 : 1;
+  V = flag_V() ? 0x80 : 0;
+  lz_op = LZ_NONE;
+}
+
 /* handle condition code register */
 
 unsigned get_cc (void)
@@ -206,9 +306,9 @@ unsigned get_cc (void)
   unsigned res = EFI & (E_FLAG|F_FLAG|I_FLAG);
 
   if(H & 0x10) res |= H_FLAG;
-  if(N & 0x80) res |= N_FLAG;
-  if(Z == 0)   res |= Z_FLAG;
-  if(V & 0x80) res |= V_FLAG;
+  if(flag_N()) res |= N_FLAG;
+  if(flag_Z()) res |= Z_FLAG;
+  if(flag_V()) res |= V_FLAG;
   if(C != 0)   res |= C_FLAG;
 
   return res;
@@ -222,6 +322,7 @@ void set_cc (unsigned arg)
   Z   = (~arg)& Z_FLAG;
   V   =  (arg & V_FLAG ? 0x80 : 0);
   C   =   arg & C_FLAG; 
+  lz_op = LZ_NONE;
 }
 
 unsigned get_reg (unsigned nro)
@@ -270,8 +371,9 @@ unsigned adc (unsigned arg, unsigned val)
   unsigned res = arg + val + (C != 0);
 
   C = (res >> 1) & 0x80;
-  N = Z = res &= 0xff;
-  V = H = arg ^ val ^ res ^ C;
+  res &= 0xff;
+  H = arg ^ val ^ res;
+  LAZY1(LZ_ADD8, res, arg ^ val);
   
   return res;
 }
@@ -281,8 +383,9 @@ unsigned add (unsigned arg, unsigned val)
   unsigned res = arg + val;
 
   C = (res >> 1) & 0x80;
-  N = Z = res &= 0xff;
-  V = H = arg ^ val ^ res ^ C;
+  res &= 0xff;
+  H = arg ^ val ^ res;
+  LAZY1(LZ_ADD8, res, arg ^ val);
  
   return res;
 }
@@ -291,8 +394,7 @@ unsigned and (unsigned arg, unsigned val)
 {
   unsigned res = arg & val;
 
-  N = Z = res;
-  V = 0;
+  LAZY(LZ_LOG8, res);
 
   return res;
 }
@@ -302,8 +404,8 @@ unsigned asl (unsigned arg) /* same as lsl */
   unsigned res = arg << 1;
 
   C = res & 0x100;
-  N = Z = res &= 0xff;
-  V = arg ^ res;
+  res &= 0xff;
+  LAZY1(LZ_SHL8, res, arg);
   cpu_clk -= 2;
 
   return res;
@@ -313,6 +415,7 @@ unsigned asr (unsigned arg)
 {
   unsigned res = (INT8)arg;
 
+  flush_flags();
   C = res & 1;
   N = Z = res = (res >> 1) & 0xff;
   cpu_clk -= 2;
@@ -324,13 +427,13 @@ void bit (unsigned arg, unsigned val)
 {
   unsigned res = arg & val;
 
-  N = Z = res;
-  V = 0;
+  LAZY(LZ_LOG8, res);
 }
 
 unsigned clr (unsigned arg)
 {
-  C = N = Z = V = arg = 0;
+  C = arg = 0;
+  LAZY(LZ_LOG8, 0);
   cpu_clk -= 2;
 
   return arg;
@@ -341,16 +444,16 @@ void cmp (unsigned arg, unsigned val)
   unsigned res = arg - val;
 
   C = res & 0x100;
-  N = Z = res &= 0xff;
-  V = (arg ^ val) & (arg ^ res);
+  res &= 0xff;
+  LAZY2(LZ_SUB8, res, arg ^ val, arg);
 }
 
 unsigned com (unsigned arg)
 {
   unsigned res = arg ^ 0xff;
 
-  N = Z = res;
-  V = 0; C = 1;
+  LAZY(LZ_LOG8, res);
+  C = 1;
   cpu_clk -= 2;
 
   return res;
@@ -369,6 +472,7 @@ void daa (void)
   C |= (res & 0x100);
   A = N = Z = res &= 0xff;
   V = 0; /* fix this */
+  lz_op = LZ_NONE;
 
   cpu_clk -= 2;
 }
@@ -377,8 +481,7 @@ unsigned dec (unsigned arg)
 {
   unsigned res = (arg - 1) & 0xff;
 
-  N = Z = res;
-  V = arg & ~res;
+  LAZY1(LZ_DEC8, res, arg);
   cpu_clk -= 2;
 
   return res;
@@ -388,17 +491,15 @@ unsigned eor (unsigned arg, unsigned val)
 {
   unsigned res = arg ^ val;
 
-  N = Z = res;
-  V = 0;
+  LAZY(LZ_LOG8, res);
 
   return res;
 }
 
-void exg (void)
+void exg (unsigned post)
 {
   unsigned tmp1 = 0xff;
   unsigned tmp2 = 0xff;
-  unsigned post = imm_byte();
 
   if(((post ^ (post << 4)) & 0x80) == 0)
   {
@@ -416,8 +517,7 @@ unsigned inc (unsigned arg)
 {
   unsigned res = (arg + 1) & 0xff;
 
-  N = Z = res;
-  V = ~arg & res;
+  LAZY1(LZ_INC8, res, arg);
   cpu_clk -= 2;
 
   return res;
@@ -427,8 +527,7 @@ unsigned ld (unsigned arg)
 {
   unsigned res = arg;
 
-  N = Z = res;
-  V = 0;
+  LAZY(LZ_LOG8, res);
 
   return res;
 }
@@ -437,6 +536,7 @@ unsigned lsr (unsigned arg)
 {
   unsigned res = arg >> 1;
  
+  flush_flags();
   N = 0;
   Z = res;
   C = arg & 1;
@@ -449,6 +549,7 @@ void mul (void)
 {
   unsigned res = (A * B) & 0xffff;
 
+  flush_flags();
   Z = res;
   C = res & 0x80;
   A = res >> 8;
@@ -460,8 +561,8 @@ unsigned neg (int arg)
 {
   unsigned res = (-arg) & 0xff;
 
-  C = N = Z = res;
-  V = res & arg;
+  C = res;
+  LAZY1(LZ_NEG8, res, arg);
   cpu_clk -= 2;
 
   return res;
@@ -471,8 +572,7 @@ unsigned or (unsigned arg, unsigned val)
 {
   unsigned res = arg | val;
 
-  N = Z = res;
-  V = 0;
+  LAZY(LZ_LOG8, res);
 
   return res;
 }
@@ -482,8 +582,8 @@ unsigned rol (unsigned arg)
   unsigned res = (arg << 1) + (C != 0);
 
   C = res & 0x100;
-  N = Z = res &= 0xff;
-  V = arg ^ res;
+  res &= 0xff;
+  LAZY1(LZ_SHL8, res, arg);
   cpu_clk -= 2;
 
   return res;
@@ -493,6 +593,7 @@ unsigned ror (unsigned arg)
 {
   unsigned res = arg;
 
+  flush_flags();
   if(C != 0) res |= 0x100;
   C = res & 1;
   N = Z = res >>= 1;
@@ -506,8 +607,8 @@ unsigned sbc (unsigned arg, unsigned val)
   unsigned res = arg - val - (C != 0);
 
   C = res & 0x100;
-  N = Z = res &= 0xff;
-  V = (arg ^ val) & (arg ^ res);
+  res &= 0xff;
+  LAZY2(LZ_SUB8, res, arg ^ val, arg);
 
   return res;
 }
@@ -516,8 +617,7 @@ void st (unsigned arg)
 {
   unsigned res = arg;
 
-  N = Z = res;
-  V = 0;
+  LAZY(LZ_LOG8, res);
   
   WRMEM(ea,res);
 }
@@ -527,8 +627,8 @@ unsigned sub (unsigned arg, unsigned val)
   unsigned res = arg - val;
 
   C = res & 0x100;
-  N = Z = res &= 0xff;
-  V = (arg ^ val) & (arg ^ res);
+  res &= 0xff;
+  LAZY2(LZ_SUB8, res, arg ^ val, arg);
 
   return res;
 }
@@ -537,15 +637,13 @@ void tst (unsigned arg)
 {
   unsigned res = arg;
 
-  N = Z = res;
-  V = 0;
+  LAZY(LZ_LOG8, res);
   cpu_clk -= 2;
 }
 
-void tfr (void)
+void tfr (unsigned post)
 {
   unsigned tmp1 = 0xff;
-  unsigned post = imm_byte();
 
   if(((post ^ (post << 4)) & 0x80) == 0) tmp1 = get_reg(post >> 4);
 
@@ -569,9 +667,9 @@ void addd (unsigned val)
   unsigned res = arg + val;
 
   C = res & 0x10000;
-  Z = res &= 0xffff;
-  V = ((arg^res) & (val^res)) >> 8;
-  A = N = res >> 8;
+  res &= 0xffff;
+  LAZY2(LZ_ADD16, res, arg, val);
+  A = res >> 8;
   B = res & 0xff;
 }
 
@@ -580,28 +678,24 @@ void cmp16 (unsigned arg, unsigned val)
   unsigned res = arg - val;
 
   C = res & 0x10000;
-  Z = res &= 0xffff;
-  N = res >> 8;
-  V = ((arg ^ val) & (arg ^ res)) >> 8;
+  res &= 0xffff;
+  LAZY2(LZ_SUB16, res, arg ^ val, arg);
 }
 
 void ldd (unsigned arg)
 {
   unsigned res = arg;
 
-  Z = res;
-  A = N = res >> 8;
+  LAZY(LZ_LOG16, res);
+  A = res >> 8;
   B = res & 0xff;
-  V = 0;
 }
 
 unsigned ld16 (unsigned arg)
 {
   unsigned res = arg;
 
-  Z = res;
-  N = res >> 8;
-  V = 0;
+  LAZY(LZ_LOG16, res);
 
   return res;
 }
@@ -610,6 +704,7 @@ void sex (void)
 {
   unsigned res = B;
 
+  flush_flags();
   Z = res;
   N = res &= 0x80;
   if(res != 0) res = 0xff;
@@ -621,9 +716,7 @@ void std (void)
 {
   unsigned res = (A << 8) | B;
 
-  Z = res;
-  N = A;
-  V = 0;
+  LAZY(LZ_LOG16, res);
   WRMEM16(ea,res);
 }
 
@@ -631,9 +724,7 @@ void st16 (unsigned arg)
 {
   unsigned res = arg;
 
-  Z = res;
-  N = res >> 8;
-  V = 0;
+  LAZY(LZ_LOG16, res);
   WRMEM16(ea,res);
 }
 
@@ -643,17 +734,16 @@ void subd (unsigned val)
   unsigned res = arg - val;
 
   C = res & 0x10000;
-  Z = res &= 0xffff;
-  V = ((arg ^ val) & (arg ^ res)) >> 8;
-  A = N = res >> 8;
+  res &= 0xffff;
+  LAZY2(LZ_SUB16, res, arg ^ val, arg);
+  A = res >> 8;
   B = res & 0xff;
 }
 
 /* stack instructions */
 
-void pshs (void)
+void pshs (unsigned post)
 {
-  unsigned post = imm_byte();
 
   cpu_clk -= 5;
   
@@ -667,9 +757,8 @@ void pshs (void)
   if(post & 0x01) { cpu_clk -= 1; S = (S - 1) & 0xffff; write_stack(S, get_cc()); } 
 }
 
-void pshu (void)
+void pshu (unsigned post)
 {
-  unsigned post = imm_byte();
 
   cpu_clk -= 5;
 
@@ -683,9 +772,8 @@ void pshu (void)
   if(post & 0x01) { cpu_clk -= 1; U = (U - 1) & 0xffff; write_stack(U, get_cc()); } 
 }
 
-void puls (void)
+void puls (unsigned post)
 {
-  unsigned post = imm_byte();
 
   cpu_clk -= 5;
 
@@ -698,14 +786,14 @@ void puls (void)
   if(post & 0x40) { cpu_clk -= 2; U   = read_stack16(S);     S = (S + 2) & 0xffff; }
   if(post & 0x80) {
     cpu_clk -= 2; cPC  = read_stack16(S);     S = (S + 2) & 0xffff;
+    if (prof_period) prof_return(S);
     if (debugout!=NULL)
       fprintf(debugout, " RTS to %04X X=%04X D=%04X\n", cPC, get_x(), get_d());
   }
 }
 
-void pulu (void)
+void pulu (unsigned post)
 {
-  unsigned post = imm_byte();
 
   cpu_clk -= 5;
 
@@ -730,12 +818,14 @@ void jsr (void)
 {
   S = (S - 2) & 0xffff; write_stack16(S, cPC & 0xffff);     
   cPC = ea;
+  if (prof_period) prof_call(cPC, S);
   printcall(" JSR");
 }
 
 void rti (void)
 {
   unsigned newEFI;
+  unsigned frame = S;
 
   cpu_clk -= 6;
   newEFI= read_stack(S); S = (S + 1) & 0xffff;
@@ -753,6 +843,8 @@ void rti (void)
 
   set_cc(newEFI);
   cPC  = read_stack16(S);     S = (S + 2) & 0xffff;
+  if (prof_period) prof_return(S);
+  if (sc_trace) sc_return(frame);
   if (debugout!=NULL)
       fprintf(debugout, " RTI to %04X X=%04X D=%04X\n", cPC, get_x(), get_d());
 }
@@ -761,6 +853,7 @@ void rts (void)
 {
   cpu_clk -= 5;
   cPC  = read_stack16(S);     S = (S + 2) & 0xffff;
+  if (prof_period) prof_return(S);
   if (debugout!=NULL) fprintf(debugout, " RTS to %04X X=%04X, D=%04X\n",
 						cPC, get_x(), get_d());
 }
@@ -782,6 +875,7 @@ void swi (void)
   S = (S - 1) & 0xffff; write_stack(S, get_cc());
   EFI |= (I_FLAG|F_FLAG);
 
+  if (prof_period) prof_interrupt(PROF_SWI, S);
   cPC = (memory(0xfffa) << 8) | memory(0xfffb);
   set_io_active();
 }
@@ -789,6 +883,7 @@ void swi (void)
 void swi2 (void)
 {
   cpu_clk -= 20;
+  if (sc_trace) sc_call(S);
   EFI |= E_FLAG;
   S = (S - 2) & 0xffff; write_stack16(S, cPC & 0xffff);
   S = (S - 2) & 0xffff; write_stack16(S, U);
@@ -799,6 +894,7 @@ void swi2 (void)
   S = (S - 1) & 0xffff; write_stack(S, A);
   S = (S - 1) & 0xffff; write_stack(S, get_cc());
 
+  if (prof_period) prof_interrupt(PROF_SWI2, S);
   cPC = (memory(0xfff4) << 8) | memory(0xfff5);
   printcall(" SWI2");
   set_io_active();
@@ -817,6 +913,7 @@ void swi3 (void)
   S = (S - 1) & 0xffff; write_stack(S, A);
   S = (S - 1) & 0xffff; write_stack(S, get_cc());
 
+  if (prof_period) prof_interrupt(PROF_SWI3, S);
   cPC = (memory(0xfff2) << 8) | memory(0xfff3);
   set_io_active();
 }
@@ -835,10 +932,31 @@ void irq (void)
   S = (S - 1) & 0xffff; write_stack(S, get_cc());
   EFI |= (I_FLAG);
 
+  if (prof_period) prof_interrupt(PROF_IRQ, S);
   cPC = (memory(0xfff8) << 8) | memory(0xfff9);
   set_io_active();
 }
 
+/* There has been a page fault */
+void nmi (void)
+{
+  cpu_clk -= 19;
+  EFI |= E_FLAG;
+  S = (S - 2) & 0xffff; write_stack16(S, cPC & 0xffff);
+  S = (S - 2) & 0xffff; write_stack16(S, U);
+  S = (S - 2) & 0xffff; write_stack16(S,  Y);
+  S = (S - 2) & 0xffff; write_stack16(S,  X);
+  S = (S - 1) & 0xffff; write_stack(S, DP >> 8);
+  S = (S - 1) & 0xffff; write_stack(S, B);
+  S = (S - 1) & 0xffff; write_stack(S, A);
+  S = (S - 1) & 0xffff; write_stack(S, get_cc());
+  EFI |= (I_FLAG|F_FLAG);
+
+  if (prof_period) prof_interrupt(PROF_NMI, S);
+  cPC = (memory(0xfffc) << 8) | memory(0xfffd);
+  set_io_active();
+}
+
 void firq (void)
 {
   cpu_clk -= 7;
@@ -846,6 +964,7 @@ void firq (void)
   S = (S - 1) & 0xffff; write_stack(S, get_cc());
   EFI = F_FLAG|I_FLAG;
 
+  if (prof_period) prof_interrupt(PROF_FIRQ, S);
   cPC = (memory(0xfff6) << 8) | memory(0xfff7);
   set_io_active();
   if (debugout!=NULL) {
@@ -853,6 +972,94 @@ void firq (void)
   }
 }
 
+/* Idle loop detection. The kernel busy-waits for the IRQ and FIRQ
+   handlers to change something in memory. If the CPU comes back to
+   the target of a backward branch with the same registers and with
+   no stores or I/O reads in between, the loop will keep doing the
+   same thing until there is an interrupt. So we wait for one on
+   the host instead of burning a core. */
+static unsigned idle_pc = 0x10000;	// Target of the last backward branch
+static unsigned idle_stores;		// store_count when we got there
+static int idle_seen;			// Have we saved the registers?
+static unsigned idle_regs[8];		// and the registers
+static int rtc_clk = INT_MIN;		// cpu_clk of the next RTC interrupt
+static int replay_clk = INT_MIN;	// and of the next -K character
+
+/* The CPU can do nothing until there is an interrupt, so wait for
+   keyboard input or the RTC. Without -c, the cycles it would have spent
+   spinning aren't counted, so that a cycle budget is only used
+   up by real work. The exception is the cycles up to an RTC
+   interrupt, as the RTC keeps its time in cycles. */
+static void cpu_idle (void)
+{
+  int clk;
+
+  // Not if an IRQ is on its way, or the monitor is single-stepping
+  if (((input_ready || rtc_irq) && (EFI & I_FLAG)==0) || inst_count != 0)
+    return;
+
+  // With -S, the machine is now booted and waiting for input
+  if (snapfile != NULL) {
+    save_snapshot(snapfile); exit(0);
+  }
+
+  // The RTC will interrupt, so skip the cycles up to it, even
+  // if the input has ended. When pacing, skip a quantum at a time
+  // so that pace() sleeps and keyboard input can still come in.
+  // With -K, stop at the next character, so that the replay
+  // skips to the same cycles as the recording did.
+  if (rtc_clk != INT_MIN && (EFI & I_FLAG)==0) {
+    idle_pc = 0x10000;
+    clk = (rtc_clk > 0) ? rtc_clk : 0;
+    if (clk < replay_clk) clk = replay_clk;
+    if (pace_hz && clk < cpu_clk - pace_quantum) clk = cpu_clk - pace_quantum;
+    if (clk < cpu_clk) cpu_clk = clk;
+    return;
+  }
+
+  // With -K, keep running until the next character is due.
+  // Its cycle was counted from when the wait ended.
+  if (replaying && replay_at != LLONG_MAX) {
+    idle_pc = 0x10000; return;
+  }
+
+  // Nothing can wake the CPU up once the input has
+  // ended, e.g. when running headless from a file. Stop
+  // the period here so that only the cycles run are counted.
+  if (wait_for_input() == 0) {
+    if (cpu_clk > 0) { cpu_period -= cpu_clk; cpu_clk = 0; }
+    cpu_quit = 0;
+    return;
+  }
+
+  idle_pc = 0x10000;
+  if (pace_hz == 0) return;
+
+  // When pacing, only skip the cycles which the wall clock went
+  // past while we waited. If we didn't wait, skip a quantum so
+  // that pace() sleeps instead of us spinning here.
+  clk = cpu_period - pace_skip(cpu_period);
+  cpu_clk = (clk < cpu_clk) ? clk : cpu_clk - pace_quantum;
+}
+
+static void idle_check (void)
+{
+  unsigned regs[8];
+
+  // A different loop, or a store since we were last here
+  if (cPC != idle_pc || store_count != idle_stores) {
+    idle_pc = cPC; idle_stores = store_count; idle_seen = 0;
+    return;
+  }
+
+  regs[0] = A; regs[1] = B; regs[2] = X; regs[3] = Y; regs[4] = U;
+  regs[5] = S; regs[6] = DP; regs[7] = get_cc();
+  if (idle_seen && memcmp(regs, idle_regs, sizeof(regs)) == 0) {
+    cpu_idle(); return;
+  }
+  memcpy(idle_regs, regs, sizeof(regs)); idle_seen = 1;
+}
+
 void cwai (void)
 {
   puts("CWAI - not suported yet!");
@@ -862,105 +1069,799 @@ void sync (void)
 {
   cPC--; doing_sync=1;	// Keep doing this instruction
   cpu_clk -= 4;
+  cpu_idle();		// and wait for an interrupt
 }
 
-void orcc (void)
+void orcc (unsigned tmp)
 {
-  unsigned tmp = imm_byte();
-
   set_cc( get_cc() | tmp);
   cpu_clk -= 3;
 }
 
-void andcc (void)
+void andcc (unsigned tmp)
 {
-  unsigned tmp = imm_byte();
-
   set_cc( get_cc() & tmp);
   cpu_clk -= 3;
 }
 
 /* Branch Instructions */
 
-#define cond_HI() ((Z != 0) && (C == 0))
-#define cond_LS() ((Z == 0) || (C != 0))
+#define cond_HI() (!flag_Z() && (C == 0))
+#define cond_LS() (flag_Z() || (C != 0))
 #define cond_HS() (C == 0)
 #define cond_LO() (C != 0)
-#define cond_NE() (Z != 0)
-#define cond_EQ() (Z == 0)
-#define cond_VC() ((V & 0x80) == 0)
-#define cond_VS() ((V & 0x80) != 0)
-#define cond_PL() ((N & 0x80) == 0)
-#define cond_MI() ((N & 0x80) != 0)
-#define cond_GE() (((N^V) & 0x80) == 0)
-#define cond_LT() (((N^V) & 0x80) != 0)
-#define cond_GT() ((((N^V) & 0x80) == 0) && (Z != 0))
-#define cond_LE() ((((N^V) & 0x80) != 0) || (Z == 0))
+#define cond_NE() (!flag_Z())
+#define cond_EQ() (flag_Z())
+#define cond_VC() (!flag_V())
+#define cond_VS() (flag_V())
+#define cond_PL() (!flag_N())
+#define cond_MI() (flag_N())
+#define cond_GE() (flag_N() == flag_V())
+#define cond_LT() (flag_N() != flag_V())
+#define cond_GT() ((flag_N() == flag_V()) && !flag_Z())
+#define cond_LE() ((flag_N() != flag_V()) || flag_Z())
+
+/* The branch offset has been sign-extended by decode_inst(),
+   and cPC already points at the next instruction */
 
-void bra (void)
+void bra (unsigned offset)
 {
-  INT8 tmp = (INT8)imm_byte();
-  cPC += tmp;
+  cPC = (cPC + offset) & 0xffff;
+  if (offset & 0x8000) idle_check();
 }
 
-void branch (unsigned cond)
+void branch (unsigned cond, unsigned offset)
 {
-  if (cond) bra();
-  else cPC++;
+  if (cond) bra(offset);
 
   cpu_clk -= 3;
 }
 
-void long_bra (void)
-{
-  INT16 tmp = (INT16)imm_word();
-  cPC += tmp;
-}
-
-void long_branch (unsigned cond)
+void long_branch (unsigned cond, unsigned offset)
 {
   if (cond)
   {
-    long_bra();
+    bra(offset);
     cpu_clk -= 6;
   }
   else
   {
-    cPC += 2;
     cpu_clk -= 5;
   }
 }
 
-void long_bsr (void)
+void long_bsr (unsigned offset)
 {
-  INT16 tmp = (INT16)imm_word();
-  ea = cPC + tmp;
+  ea = (cPC + offset) & 0xffff;
   S = (S - 2) & 0xffff; write_stack16(S, cPC & 0xffff);     
   cPC = ea;
+  if (prof_period) prof_call(cPC, S);
   printcall("LBSR");
   cpu_clk -= 9;
 }
 
-void bsr (void)
+void bsr (unsigned offset)
 {
-  INT8 tmp = (INT8)imm_byte();
-  ea = cPC + tmp;
+  ea = (cPC + offset) & 0xffff;
   S = (S - 2) & 0xffff; write_stack16(S, cPC & 0xffff);     
   cPC = ea;
+  if (prof_period) prof_call(cPC, S);
   printcall(" BSR");
   cpu_clk -= 7;
 }
 
+/* Instruction handlers. Each is passed its decoded instruction. The
+   base cycles have been taken off, cPC points at the next instruction
+   and ea holds the effective address for memory operands. */
+
+#define INH(name, stmt) \
+  static void name (struct dinst *d) { stmt; }
+
+/* 8-bit and 16-bit operations with both an immediate and a memory form */
+#define OP8(name, stmt) \
+  static void name##_i (struct dinst *d) { unsigned val = d->operand;  stmt; } \
+  static void name##_m (struct dinst *d) { unsigned val = RDMEM(ea);   stmt; }
+
+#define OP16(name, stmt) \
+  static void name##_i (struct dinst *d) { unsigned val = d->operand;  stmt; } \
+  static void name##_m (struct dinst *d) { unsigned val = RDMEM16(ea); stmt; }
+
+#define BRANCH(name, cond) \
+  static void op_##name  (struct dinst *d) { branch(cond, d->operand); } \
+  static void op_l##name (struct dinst *d) { long_branch(cond, d->operand); }
+
+INH(op_neg_m, WRMEM(ea, neg(RDMEM(ea))))
+INH(op_com_m, WRMEM(ea, com(RDMEM(ea))))
+INH(op_lsr_m, WRMEM(ea, lsr(RDMEM(ea))))
+INH(op_ror_m, WRMEM(ea, ror(RDMEM(ea))))
+INH(op_asr_m, WRMEM(ea, asr(RDMEM(ea))))
+INH(op_asl_m, WRMEM(ea, asl(RDMEM(ea))))
+INH(op_rol_m, WRMEM(ea, rol(RDMEM(ea))))
+INH(op_dec_m, WRMEM(ea, dec(RDMEM(ea))))
+INH(op_inc_m, WRMEM(ea, inc(RDMEM(ea))))
+INH(op_tst_m,           tst(RDMEM(ea)))
+INH(op_clr_m, WRMEM(ea, clr(RDMEM(ea))))
+INH(op_jmp,   cPC = ea)
+
+INH(op_nega, A = neg(A))
+INH(op_coma, A = com(A))
+INH(op_lsra, A = lsr(A))
+INH(op_rora, A = ror(A))
+INH(op_asra, A = asr(A))
+INH(op_asla, A = asl(A))
+INH(op_rola, A = rol(A))
+INH(op_deca, A = dec(A))
+INH(op_inca, A = inc(A))
+INH(op_tsta,     tst(A))
+INH(op_clra, A = clr(A))
+
+INH(op_negb, B = neg(B))
+INH(op_comb, B = com(B))
+INH(op_lsrb, B = lsr(B))
+INH(op_rorb, B = ror(B))
+INH(op_asrb, B = asr(B))
+INH(op_aslb, B = asl(B))
+INH(op_rolb, B = rol(B))
+INH(op_decb, B = dec(B))
+INH(op_incb, B = inc(B))
+INH(op_tstb,     tst(B))
+INH(op_clrb, B = clr(B))
+
+INH(op_nop,   nop())
+INH(op_sync,  sync())
+INH(op_lbra,  bra(d->operand))
+INH(op_lbsr,  long_bsr(d->operand))
+INH(op_daa,   daa())
+INH(op_orcc,  orcc(d->operand))
+INH(op_andcc, andcc(d->operand))
+INH(op_sex,   sex())
+INH(op_exg,   exg(d->operand))
+INH(op_tfr,   tfr(d->operand))
+INH(op_bra,   bra(d->operand))
+INH(op_brn,   (void)d)
+INH(op_bsr,   bsr(d->operand))
+
+BRANCH(bhi, cond_HI())
+BRANCH(bls, cond_LS())
+BRANCH(bhs, cond_HS())
+BRANCH(blo, cond_LO())
+BRANCH(bne, cond_NE())
+BRANCH(beq, cond_EQ())
+BRANCH(bvc, cond_VC())
+BRANCH(bvs, cond_VS())
+BRANCH(bpl, cond_PL())
+BRANCH(bmi, cond_MI())
+BRANCH(bge, cond_GE())
+BRANCH(blt, cond_LT())
+BRANCH(bgt, cond_GT())
+BRANCH(ble, cond_LE())
+
+INH(op_leax, flush_flags(); Z = X = ea)
+INH(op_leay, flush_flags(); Z = Y = ea)
+INH(op_leas, S = ea)
+INH(op_leau, U = ea)
+INH(op_pshs, pshs(d->operand))
+INH(op_puls, puls(d->operand))
+INH(op_pshu, pshu(d->operand))
+INH(op_pulu, pulu(d->operand))
+INH(op_rts,  rts())
+INH(op_abx,  abx())
+INH(op_rti,  rti())
+INH(op_cwai, cwai())
+INH(op_mul,  mul())
+INH(op_swi,  swi())
+INH(op_swi2, swi2())
+INH(op_swi3, swi3())
+INH(op_jsr,  jsr())
+
+OP8(op_suba, A = sub(A, val))
+OP8(op_cmpa,     cmp(A, val))
+OP8(op_sbca, A = sbc(A, val))
+OP8(op_anda, A = and(A, val))
+OP8(op_bita,     bit(A, val))
+OP8(op_lda,  A = ld(val))
+OP8(op_eora, A = eor(A, val))
+OP8(op_adca, A = adc(A, val))
+OP8(op_ora,  A = or(A, val))
+OP8(op_adda, A = add(A, val))
+
+OP8(op_subb, B = sub(B, val))
+OP8(op_cmpb,     cmp(B, val))
+OP8(op_sbcb, B = sbc(B, val))
+OP8(op_andb, B = and(B, val))
+OP8(op_bitb,     bit(B, val))
+OP8(op_ldb,  B = ld(val))
+OP8(op_eorb, B = eor(B, val))
+OP8(op_adcb, B = adc(B, val))
+OP8(op_orb,  B = or(B, val))
+OP8(op_addb, B = add(B, val))
+
+OP16(op_subd,     subd(val))
+OP16(op_addd,     addd(val))
+OP16(op_ldd,      ldd(val))
+OP16(op_cmpd,     cmp16(get_d(), val))
+OP16(op_cmpx,     cmp16(X, val))
+OP16(op_cmpy,     cmp16(Y, val))
+OP16(op_cmpu,     cmp16(U, val))
+OP16(op_cmps,     cmp16(S, val))
+OP16(op_ldx,  X = ld16(val))
+OP16(op_ldy,  Y = ld16(val))
+OP16(op_ldu,  U = ld16(val))
+OP16(op_lds,  S = ld16(val))
+
+INH(op_sta, st(A))
+INH(op_stb, st(B))
+INH(op_std, std())
+INH(op_stx, st16(X))
+INH(op_sty, st16(Y))
+INH(op_stu, st16(U))
+INH(op_sts, st16(S))
+
+static void op_illegal (struct dinst *d)
+{
+  if (d->opcode > 0xff)
+    printf("%X: invalid opcode $%04X\n",iPC,d->opcode);
+  else
+    printf("%04X: invalid opcode $%02X\n",iPC,d->opcode);
+  itrace_dump("invalid opcode");
+  monitor_on = 1;
+}
+
+/* The opcode tables. For each opcode there is the handler, the
+   addressing mode and the cycles not taken off by the handler itself.
+   Missing entries are invalid opcodes. */
+
+struct opentry
+{
+  void (*fn)(struct dinst *);
+  UINT8 mode;
+  INT8 cycles;
+};
+
+static const struct opentry page0[256] =
+{
+  [0x00] = { op_neg_m,  M_DIR,   4 },
+  [0x03] = { op_com_m,  M_DIR,   4 },
+  [0x04] = { op_lsr_m,  M_DIR,   4 },
+  [0x06] = { op_ror_m,  M_DIR,   4 },
+  [0x07] = { op_asr_m,  M_DIR,   4 },
+  [0x08] = { op_asl_m,  M_DIR,   4 },
+  [0x09] = { op_rol_m,  M_DIR,   4 },
+  [0x0a] = { op_dec_m,  M_DIR,   4 },
+  [0x0c] = { op_inc_m,  M_DIR,   4 },
+  [0x0d] = { op_tst_m,  M_DIR,   4 },
+  [0x0e] = { op_jmp,    M_DIR,   3 },
+  [0x0f] = { op_clr_m,  M_DIR,   4 },
+
+  [0x12] = { op_nop,    M_INH,   0 },
+  [0x13] = { op_sync,   M_INH,   0 },
+  [0x16] = { op_lbra,   M_REL16, 5 },
+  [0x17] = { op_lbsr,   M_REL16, 0 },
+  [0x19] = { op_daa,    M_INH,   0 },
+  [0x1a] = { op_orcc,   M_IMM8,  0 },
+  [0x1c] = { op_andcc,  M_IMM8,  0 },
+  [0x1d] = { op_sex,    M_INH,   0 },
+  [0x1e] = { op_exg,    M_IMM8,  0 },
+  [0x1f] = { op_tfr,    M_IMM8,  0 },
+
+  [0x20] = { op_bra,    M_REL8,  3 },
+  [0x21] = { op_brn,    M_REL8,  3 },
+  [0x22] = { op_bhi,    M_REL8,  0 },
+  [0x23] = { op_bls,    M_REL8,  0 },
+  [0x24] = { op_bhs,    M_REL8,  0 },
+  [0x25] = { op_blo,    M_REL8,  0 },
+  [0x26] = { op_bne,    M_REL8,  0 },
+  [0x27] = { op_beq,    M_REL8,  0 },
+  [0x28] = { op_bvc,    M_REL8,  0 },
+  [0x29] = { op_bvs,    M_REL8,  0 },
+  [0x2a] = { op_bpl,    M_REL8,  0 },
+  [0x2b] = { op_bmi,    M_REL8,  0 },
+  [0x2c] = { op_bge,    M_REL8,  0 },
+  [0x2d] = { op_blt,    M_REL8,  0 },
+  [0x2e] = { op_bgt,    M_REL8,  0 },
+  [0x2f] = { op_ble,    M_REL8,  0 },
+
+  [0x30] = { op_leax,   M_IDX,   0 },
+  [0x31] = { op_leay,   M_IDX,   0 },
+  [0x32] = { op_leas,   M_IDX,   0 },
+  [0x33] = { op_leau,   M_IDX,   0 },
+  [0x34] = { op_pshs,   M_IMM8,  0 },
+  [0x35] = { op_puls,   M_IMM8,  0 },
+  [0x36] = { op_pshu,   M_IMM8,  0 },
+  [0x37] = { op_pulu,   M_IMM8,  0 },
+  [0x39] = { op_rts,    M_INH,   0 },
+  [0x3a] = { op_abx,    M_INH,   0 },
+  [0x3b] = { op_rti,    M_INH,   0 },
+  [0x3c] = { op_cwai,   M_INH,   0 },
+  [0x3d] = { op_mul,    M_INH,   0 },
+  [0x3f] = { op_swi,    M_INH,   0 },
+
+  [0x40] = { op_nega,   M_INH,   0 },
+  [0x43] = { op_coma,   M_INH,   0 },
+  [0x44] = { op_lsra,   M_INH,   0 },
+  [0x46] = { op_rora,   M_INH,   0 },
+  [0x47] = { op_asra,   M_INH,   0 },
+  [0x48] = { op_asla,   M_INH,   0 },
+  [0x49] = { op_rola,   M_INH,   0 },
+  [0x4a] = { op_deca,   M_INH,   0 },
+  [0x4c] = { op_inca,   M_INH,   0 },
+  [0x4d] = { op_tsta,   M_INH,   0 },
+  [0x4f] = { op_clra,   M_INH,   0 },
+
+  [0x50] = { op_negb,   M_INH,   0 },
+  [0x53] = { op_comb,   M_INH,   0 },
+  [0x54] = { op_lsrb,   M_INH,   0 },
+  [0x56] = { op_rorb,   M_INH,   0 },
+  [0x57] = { op_asrb,   M_INH,   0 },
+  [0x58] = { op_aslb,   M_INH,   0 },
+  [0x59] = { op_rolb,   M_INH,   0 },
+  [0x5a] = { op_decb,   M_INH,   0 },
+  [0x5c] = { op_incb,   M_INH,   0 },
+  [0x5d] = { op_tstb,   M_INH,   0 },
+  [0x5f] = { op_clrb,   M_INH,   0 },
+
+  [0x60] = { op_neg_m,  M_IDX,   0 },
+  [0x63] = { op_com_m,  M_IDX,   0 },
+  [0x64] = { op_lsr_m,  M_IDX,   0 },
+  [0x66] = { op_ror_m,  M_IDX,   0 },
+  [0x67] = { op_asr_m,  M_IDX,   0 },
+  [0x68] = { op_asl_m,  M_IDX,   0 },
+  [0x69] = { op_rol_m,  M_IDX,   0 },
+  [0x6a] = { op_dec_m,  M_IDX,   0 },
+  [0x6c] = { op_inc_m,  M_IDX,   0 },
+  [0x6d] = { op_tst_m,  M_IDX,   0 },
+  [0x6e] = { op_jmp,    M_IDX,  -1 },
+  [0x6f] = { op_clr_m,  M_IDX,   0 },
+
+  [0x70] = { op_neg_m,  M_EXT,   5 },
+  [0x73] = { op_com_m,  M_EXT,   5 },
+  [0x74] = { op_lsr_m,  M_EXT,   5 },
+  [0x76] = { op_ror_m,  M_EXT,   5 },
+  [0x77] = { op_asr_m,  M_EXT,   5 },
+  [0x78] = { op_asl_m,  M_EXT,   5 },
+  [0x79] = { op_rol_m,  M_EXT,   5 },
+  [0x7a] = { op_dec_m,  M_EXT,   5 },
+  [0x7c] = { op_inc_m,  M_EXT,   5 },
+  [0x7d] = { op_tst_m,  M_EXT,   5 },
+  [0x7e] = { op_jmp,    M_EXT,   4 },
+  [0x7f] = { op_clr_m,  M_EXT,   5 },
+
+  [0x80] = { op_suba_i, M_IMM8,  2 },
+  [0x81] = { op_cmpa_i, M_IMM8,  2 },
+  [0x82] = { op_sbca_i, M_IMM8,  2 },
+  [0x83] = { op_subd_i, M_IMM16, 4 },
+  [0x84] = { op_anda_i, M_IMM8,  2 },
+  [0x85] = { op_bita_i, M_IMM8,  2 },
+  [0x86] = { op_lda_i,  M_IMM8,  2 },
+  [0x88] = { op_eora_i, M_IMM8,  2 },
+  [0x89] = { op_adca_i, M_IMM8,  2 },
+  [0x8a] = { op_ora_i,  M_IMM8,  2 },
+  [0x8b] = { op_adda_i, M_IMM8,  2 },
+  [0x8c] = { op_cmpx_i, M_IMM16, 4 },
+  [0x8d] = { op_bsr,    M_REL8,  0 },
+  [0x8e] = { op_ldx_i,  M_IMM16, 3 },
+
+  [0x90] = { op_suba_m, M_DIR,   4 },
+  [0x91] = { op_cmpa_m, M_DIR,   4 },
+  [0x92] = { op_sbca_m, M_DIR,   4 },
+  [0x93] = { op_subd_m, M_DIR,   5 },
+  [0x94] = { op_anda_m, M_DIR,   4 },
+  [0x95] = { op_bita_m, M_DIR,   4 },
+  [0x96] = { op_lda_m,  M_DIR,   4 },
+  [0x97] = { op_sta,    M_DIR,   4 },
+  [0x98] = { op_eora_m, M_DIR,   4 },
+  [0x99] = { op_adca_m, M_DIR,   4 },
+  [0x9a] = { op_ora_m,  M_DIR,   4 },
+  [0x9b] = { op_adda_m, M_DIR,   4 },
+  [0x9c] = { op_cmpx_m, M_DIR,   5 },
+  [0x9d] = { op_jsr,    M_DIR,   7 },
+  [0x9e] = { op_ldx_m,  M_DIR,   4 },
+  [0x9f] = { op_stx,    M_DIR,   4 },
+
+  [0xa0] = { op_suba_m, M_IDX,   0 },
+  [0xa1] = { op_cmpa_m, M_IDX,   0 },
+  [0xa2] = { op_sbca_m, M_IDX,   0 },
+  [0xa3] = { op_subd_m, M_IDX,   1 },
+  [0xa4] = { op_anda_m, M_IDX,   0 },
+  [0xa5] = { op_bita_m, M_IDX,   0 },
+  [0xa6] = { op_lda_m,  M_IDX,   0 },
+  [0xa7] = { op_sta,    M_IDX,   0 },
+  [0xa8] = { op_eora_m, M_IDX,   0 },
+  [0xa9] = { op_adca_m, M_IDX,   0 },
+  [0xaa] = { op_ora_m,  M_IDX,   0 },
+  [0xab] = { op_adda_m, M_IDX,   0 },
+  [0xac] = { op_cmpx_m, M_IDX,   1 },
+  [0xad] = { op_jsr,    M_IDX,   3 },
+  [0xae] = { op_ldx_m,  M_IDX,   0 },
+  [0xaf] = { op_stx,    M_IDX,   0 },
+
+  [0xb0] = { op_suba_m, M_EXT,   5 },
+  [0xb1] = { op_cmpa_m, M_EXT,   5 },
+  [0xb2] = { op_sbca_m, M_EXT,   5 },
+  [0xb3] = { op_subd_m, M_EXT,   6 },
+  [0xb4] = { op_anda_m, M_EXT,   5 },
+  [0xb5] = { op_bita_m, M_EXT,   5 },
+  [0xb6] = { op_lda_m,  M_EXT,   5 },
+  [0xb7] = { op_sta,    M_EXT,   5 },
+  [0xb8] = { op_eora_m, M_EXT,   5 },
+  [0xb9] = { op_adca_m, M_EXT,   5 },
+  [0xba] = { op_ora_m,  M_EXT,   5 },
+  [0xbb] = { op_adda_m, M_EXT,   5 },
+  [0xbc] = { op_cmpx_m, M_EXT,   6 },
+  [0xbd] = { op_jsr,    M_EXT,   8 },
+  [0xbe] = { op_ldx_m,  M_EXT,   5 },
+  [0xbf] = { op_stx,    M_EXT,   5 },
+
+  [0xc0] = { op_subb_i, M_IMM8,  2 },
+  [0xc1] = { op_cmpb_i, M_IMM8,  2 },
+  [0xc2] = { op_sbcb_i, M_IMM8,  2 },
+  [0xc3] = { op_addd_i, M_IMM16, 4 },
+  [0xc4] = { op_andb_i, M_IMM8,  2 },
+  [0xc5] = { op_bitb_i, M_IMM8,  2 },
+  [0xc6] = { op_ldb_i,  M_IMM8,  2 },
+  [0xc8] = { op_eorb_i, M_IMM8,  2 },
+  [0xc9] = { op_adcb_i, M_IMM8,  2 },
+  [0xca] = { op_orb_i,  M_IMM8,  2 },
+  [0xcb] = { op_addb_i, M_IMM8,  2 },
+  [0xcc] = { op_ldd_i,  M_IMM16, 3 },
+  [0xce] = { op_ldu_i,  M_IMM16, 3 },
+
+  [0xd0] = { op_subb_m, M_DIR,   4 },
+  [0xd1] = { op_cmpb_m, M_DIR,   4 },
+  [0xd2] = { op_sbcb_m, M_DIR,   4 },
+  [0xd3] = { op_addd_m, M_DIR,   5 },
+  [0xd4] = { op_andb_m, M_DIR,   4 },
+  [0xd5] = { op_bitb_m, M_DIR,   4 },
+  [0xd6] = { op_ldb_m,  M_DIR,   4 },
+  [0xd7] = { op_stb,    M_DIR,   4 },
+  [0xd8] = { op_eorb_m, M_DIR,   4 },
+  [0xd9] = { op_adcb_m, M_DIR,   4 },
+  [0xda] = { op_orb_m,  M_DIR,   4 },
+  [0xdb] = { op_addb_m, M_DIR,   4 },
+  [0xdc] = { op_ldd_m,  M_DIR,   4 },
+  [0xdd] = { op_std,    M_DIR,   4 },
+  [0xde] = { op_ldu_m,  M_DIR,   4 },
+  [0xdf] = { op_stu,    M_DIR,   4 },
+
+  [0xe0] = { op_subb_m, M_IDX,   0 },
+  [0xe1] = { op_cmpb_m, M_IDX,   0 },
+  [0xe2] = { op_sbcb_m, M_IDX,   0 },
+  [0xe3] = { op_addd_m, M_IDX,   1 },
+  [0xe4] = { op_andb_m, M_IDX,   0 },
+  [0xe5] = { op_bitb_m, M_IDX,   0 },
+  [0xe6] = { op_ldb_m,  M_IDX,   0 },
+  [0xe7] = { op_stb,    M_IDX,   0 },
+  [0xe8] = { op_eorb_m, M_IDX,   0 },
+  [0xe9] = { op_adcb_m, M_IDX,   0 },
+  [0xea] = { op_orb_m,  M_IDX,   0 },
+  [0xeb] = { op_addb_m, M_IDX,   0 },
+  [0xec] = { op_ldd_m,  M_IDX,   0 },
+  [0xed] = { op_std,    M_IDX,   0 },
+  [0xee] = { op_ldu_m,  M_IDX,   0 },
+  [0xef] = { op_stu,    M_IDX,   0 },
+
+  [0xf0] = { op_subb_m, M_EXT,   5 },
+  [0xf1] = { op_cmpb_m, M_EXT,   5 },
+  [0xf2] = { op_sbcb_m, M_EXT,   5 },
+  [0xf3] = { op_addd_m, M_EXT,   6 },
+  [0xf4] = { op_andb_m, M_EXT,   5 },
+  [0xf5] = { op_bitb_m, M_EXT,   5 },
+  [0xf6] = { op_ldb_m,  M_EXT,   5 },
+  [0xf7] = { op_stb,    M_EXT,   5 },
+  [0xf8] = { op_eorb_m, M_EXT,   5 },
+  [0xf9] = { op_adcb_m, M_EXT,   5 },
+  [0xfa] = { op_orb_m,  M_EXT,   5 },
+  [0xfb] = { op_addb_m, M_EXT,   5 },
+  [0xfc] = { op_ldd_m,  M_EXT,   5 },
+  [0xfd] = { op_std,    M_EXT,   5 },
+  [0xfe] = { op_ldu_m,  M_EXT,   5 },
+  [0xff] = { op_stu,    M_EXT,   5 },
+};
+
+static const struct opentry page10[256] =
+{
+  [0x21] = { op_brn,    M_REL16, 5 },
+  [0x22] = { op_lbhi,   M_REL16, 0 },
+  [0x23] = { op_lbls,   M_REL16, 0 },
+  [0x24] = { op_lbhs,   M_REL16, 0 },
+  [0x25] = { op_lblo,   M_REL16, 0 },
+  [0x26] = { op_lbne,   M_REL16, 0 },
+  [0x27] = { op_lbeq,   M_REL16, 0 },
+  [0x28] = { op_lbvc,   M_REL16, 0 },
+  [0x29] = { op_lbvs,   M_REL16, 0 },
+  [0x2a] = { op_lbpl,   M_REL16, 0 },
+  [0x2b] = { op_lbmi,   M_REL16, 0 },
+  [0x2c] = { op_lbge,   M_REL16, 0 },
+  [0x2d] = { op_lblt,   M_REL16, 0 },
+  [0x2e] = { op_lbgt,   M_REL16, 0 },
+  [0x2f] = { op_lble,   M_REL16, 0 },
+  [0x3f] = { op_swi2,   M_INH,   0 },
+  [0x83] = { op_cmpd_i, M_IMM16, 5 },
+  [0x8c] = { op_cmpy_i, M_IMM16, 5 },
+  [0x8e] = { op_ldy_i,  M_IMM16, 4 },
+  [0x93] = { op_cmpd_m, M_DIR,   6 },
+  [0x9c] = { op_cmpy_m, M_DIR,   6 },
+  [0x9e] = { op_ldy_m,  M_DIR,   5 },
+  [0x9f] = { op_sty,    M_DIR,   5 },
+  [0xa3] = { op_cmpd_m, M_IDX,   2 },
+  [0xac] = { op_cmpy_m, M_IDX,   2 },
+  [0xae] = { op_ldy_m,  M_IDX,   1 },
+  [0xaf] = { op_sty,    M_IDX,   1 },
+  [0xb3] = { op_cmpd_m, M_EXT,   7 },
+  [0xbc] = { op_cmpy_m, M_EXT,   7 },
+  [0xbe] = { op_ldy_m,  M_EXT,   6 },
+  [0xbf] = { op_sty,    M_EXT,   6 },
+  [0xce] = { op_lds_i,  M_IMM16, 4 },
+  [0xde] = { op_lds_m,  M_DIR,   5 },
+  [0xdf] = { op_sts,    M_DIR,   5 },
+  [0xee] = { op_lds_m,  M_IDX,   1 },
+  [0xef] = { op_sts,    M_IDX,   1 },
+  [0xfe] = { op_lds_m,  M_EXT,   6 },
+  [0xff] = { op_sts,    M_EXT,   6 },
+};
+
+static const struct opentry page11[256] =
+{
+  [0x3f] = { op_swi3,   M_INH,   0 },
+  [0x83] = { op_cmpu_i, M_IMM16, 5 },
+  [0x8c] = { op_cmps_i, M_IMM16, 5 },
+  [0x93] = { op_cmpu_m, M_DIR,   6 },
+  [0x9c] = { op_cmps_m, M_DIR,   6 },
+  [0xa3] = { op_cmpu_m, M_IDX,   2 },
+  [0xac] = { op_cmps_m, M_IDX,   2 },
+  [0xb3] = { op_cmpu_m, M_EXT,   7 },
+  [0xbc] = { op_cmps_m, M_EXT,   7 },
+};
+
+/* Cycles for each indexed post byte with the top bit set, including
+   the indirect fetch. Zero means an invalid post byte. A post byte
+   with a 5-bit offset always takes 5 cycles. */
+static const UINT8 index_cycles[32] =
+{
+   6,  7,  6,  7,  4,  5,  5,  0,  5,  8,  0,  8,  5,  9,  0,  0,
+   0, 10,  0, 10,  7,  8,  8,  0,  8, 11,  0, 11,  8, 12,  0,  9
+};
+
+/* Instruction bytes don't trigger read watchpoints,
+   but they can be on an invalid page */
+static unsigned FETCH (unsigned addr)
+{
+  addr &= 0xffff;
+  if (pdt[addr >> 8].flags & PD_INVALID) page_fault(addr, PF_FETCH);
+  return(memory(addr));
+}
+
+static unsigned FETCH16 (unsigned addr)
+{
+  unsigned val = FETCH(addr) << 8;
+  return(val | FETCH(addr + 1));
+}
+
+/* Decode the instruction at pc into d */
+void decode_inst (struct dinst *d, unsigned pc)
+{
+  const struct opentry *op;
+  unsigned opcode = FETCH(pc);
+  unsigned len = 1;
+  unsigned post;
+  int cycles;
+
+  if (opcode == 0x10 || opcode == 0x11)
+  {
+    unsigned op2 = FETCH(pc + 1);
+
+    op = (opcode == 0x10) ? &page10[op2] : &page11[op2];
+    opcode = (opcode << 8) | op2;
+    len = 2;
+  }
+  else
+    op = &page0[opcode];
+
+  d->opcode = opcode;
+  d->operand = 0;
+  d->post = 0;
+
+  if (op->fn == NULL)
+  {
+    d->fn = op_illegal;
+    d->mode = M_INH;
+    d->len = len;
+    d->cycles = (len == 1) ? 2 : 0;
+    return;
+  }
+
+  d->fn = op->fn;
+  d->mode = op->mode;
+  cycles = op->cycles;
+
+  switch (op->mode)
+  {
+    case M_IMM8:
+    case M_DIR:   d->operand = FETCH(pc + len);                    len += 1; break;
+    case M_REL8:  d->operand = (INT8)FETCH(pc + len) & 0xffff;     len += 1; break;
+    case M_IMM16:
+    case M_EXT:
+    case M_REL16: d->operand = FETCH16(pc + len);                  len += 2; break;
+    case M_IDX:   post = d->post = FETCH(pc + len);                len += 1;
+                  if ((post & 0x80) == 0) { cycles += 5; break; }
+                  cycles += index_cycles[post & 0x1f];
+                  switch (post & 0x1f)
+                  {
+                    case 0x08: case 0x0c: case 0x18: case 0x1c:
+                      d->operand = (INT8)FETCH(pc + len) & 0xffff; len += 1; break;
+                    case 0x09: case 0x0d: case 0x19: case 0x1d: case 0x1f:
+                      d->operand = FETCH16(pc + len);              len += 2; break;
+                  }
+                  break;
+  }
+
+  d->len = len;
+  d->cycles = cycles;
+}
+
+/* Does this instruction end a basic block, i.e. can it
+   change the PC other than by falling through to the next one? */
+int ends_block (struct dinst *d)
+{
+  switch (d->opcode)
+  {
+    case 0x1e: return ((d->operand & 0xf0) == 0x50 || (d->operand & 0x0f) == 0x05);
+    case 0x1f: return ((d->operand & 0x0f) == 0x05);
+    case 0x35:
+    case 0x37: return ((d->operand & 0x80) != 0);
+    case 0x0e: case 0x13: case 0x16: case 0x17: case 0x39: case 0x3b:
+    case 0x3c: case 0x3f: case 0x6e: case 0x7e: case 0x8d: case 0x9d:
+    case 0xad: case 0xbd: case 0x103f: case 0x113f:
+      return (1);
+  }
+
+  return ((d->opcode >= 0x20 && d->opcode <= 0x2f) ||
+	  (d->opcode >= 0x1021 && d->opcode <= 0x102f) ||
+	  d->fn == op_illegal);
+}
+
 /* execute 6809 code */
 
 int irqdelay=1;
+int inst_hooks=0;		// Set if -t or -O want to see each instruction
+
+/* Work out the effective address of an instruction */
+static inline void find_ea (struct dinst *d)
+{
+  switch (d->mode)
+  {
+    case M_DIR: ea = DP | d->operand; break;
+    case M_EXT: ea = d->operand;      break;
+    case M_IDX: index_ea(d);          break;
+  }
+}
+
+/* Run one decoded instruction for -t and -O */
+static void run_inst_hooked (struct dinst *d)
+{
+  if (itrace) itrace_inst(d);		// With -t, record it in the ring
+  if (ophist) ophist_inst(d);		// With -O, count it
+  iPC = cPC;
+  cPC = (cPC + d->len) & 0xffff;
+  cpu_clk -= d->cycles;
+  find_ea(d);
+  if (itrace) itrace_cur->ea = ea;
+  d->fn(d);
+  if (ophist) ophist_cycles(d);
+}
+
+/* Run one decoded instruction. cPC must point at it. */
+static inline void run_inst (struct dinst *d)
+{
+  if (inst_hooks) { run_inst_hooked(d); return; }
+  iPC = cPC;
+  cPC = (cPC + d->len) & 0xffff;
+  cpu_clk -= d->cycles;
+  find_ea(d);
+  d->fn(d);
+}
+
+/* Run a translated block. Stop early if the memory mapping or
+   the code changes under us, if we need the monitor, or if we
+   run out of cycles, so that we stop on the same instruction
+   as the interpreter would. Return the number of instructions run. */
+static int run_block (struct tblock *b)
+{
+  struct dinst *d = b->inst;
+  int i;
+
+  block_exit = 0;
+  for (i = 0; i < b->ninst; )
+  {
+    run_inst(d++); i++;
+    if (block_exit | monitor_on | (cpu_clk <= 0)) break;
+  }
+  return (i);
+}
+
+/* The cpu_clk in this period at which the cycle count will reach
+   cycle, or INT_MIN if it never will */
+static int clk_at (long long cycle)
+{
+  long long clk;
+
+  if (cycle == LLONG_MAX) return (INT_MIN);
+  clk = cpu_period - (cycle - total);
+  return (clk > INT_MIN ? clk : INT_MIN);
+}
+
+static void set_replay_clk (void)
+{
+  replay_clk = clk_at(replay_at);
+}
+
+/* Set the cpu_clk at which the RTC's next interrupt is due */
+void set_rtc_clk (void)
+{
+  rtc_clk = clk_at(rtc_due);
+}
+
+/* Deal with a keyboard interrupt after running ninst instructions */
+static void check_irq (int ninst)
+{
+  // A page fault sends an NMI once the instruction is done
+  if (nmi_pending) {
+    nmi_pending = 0; nmi();
+  }
+
+  // With -K, the next recorded character arrives
+  // now and its IRQ is raised, as it was with -k
+  if (cpu_clk <= replay_clk) {
+    replay_input(); set_replay_clk();
+    irqdelay = 0;
+  }
+
+  // The RTC holds the IRQ line down until register C is read
+  if (cpu_clk <= rtc_clk) rtc_event();
+  if (rtc_irq && ((EFI & I_FLAG)==0)) {
+    if (doing_sync) {
+      doing_sync=0; cPC++;
+    }
+    if (recording) record_irq(total + cpu_period - cpu_clk);
+    irq();
+  }
+
+  // If the keyboard has a character and we're
+  // not servicing an IRQ already, do an IRQ.
+  // The input thread sets input_ready, so this is
+  // just a flag test and not a system call.
+  if (input_ready && ((EFI & I_FLAG)==0)) {
+
+    // Decrement irqdelay. Only do and IRQ if it's zero.
+    // This gives the monitor code some time to drain
+    // the last character read before getting the next one
+    irqdelay -= ninst;
+    if (irqdelay <= 0) {
+      // Stop doing the SYNC if we are doing it
+      if (doing_sync) {
+	doing_sync=0; cPC++;
+      }
+      if (recording) record_irq(total + cpu_period - cpu_clk);
+      irq();
+      irqdelay= 200;
+    }
+  }
+}
 
 int cpu_execute (int cycles)
 {
-  unsigned opcode;
+  struct dinst *d;
+  struct tblock *b;
   int monitor_result;
+  int pace_clk;
+  int prof_clk, prof_last;		// prof_last is in cycles run
 
   cpu_period = cpu_clk = cycles;
+  pace_clk = pace_hz ? cycles - pace_quantum : INT_MIN;
+  prof_clk = prof_period ? cycles - prof_period : INT_MIN;
+  prof_last = 0;
+  if (replaying) set_replay_clk();
+  set_rtc_clk();
 
   // Put terminal into cbreak mode
   ttySetCbreak();
@@ -969,347 +1870,50 @@ int cpu_execute (int cycles)
   {
     if (check_break(cPC) != 0) monitor_on = 1;
     if (monitor_on != 0) {
+      flush_output();
+      pause_input();			// Stop the input thread reading
       reset_terminal_mode();		// Go back to blocking I/O
       monitor_result= monitor6809();
       ttySetCbreak();			// Set cbreak mode again
+      resume_input();
       if (monitor_result != 0) return cpu_period - cpu_clk;
+      if (pace_hz) pace_skip(cpu_period - cpu_clk);	// Don't count the time
     }
 
-    iPC = cPC;
-    opcode = imm_byte();
-
-    switch (opcode)
-    {
-      case 0x00: direct();   cpu_clk -= 4; WRMEM(ea, neg(RDMEM(ea))); break; /* NEG direct */
-      case 0x03: direct();   cpu_clk -= 4; WRMEM(ea, com(RDMEM(ea))); break; /* COM direct */
-      case 0x04: direct();   cpu_clk -= 4; WRMEM(ea, lsr(RDMEM(ea))); break; /* LSR direct */
-      case 0x06: direct();   cpu_clk -= 4; WRMEM(ea, ror(RDMEM(ea))); break; /* ROR direct */
-      case 0x07: direct();   cpu_clk -= 4; WRMEM(ea, asr(RDMEM(ea))); break; /* ASR direct */
-      case 0x08: direct();   cpu_clk -= 4; WRMEM(ea, asl(RDMEM(ea))); break; /* ASL direct */
-      case 0x09: direct();   cpu_clk -= 4; WRMEM(ea, rol(RDMEM(ea))); break; /* ROL direct */
-      case 0x0a: direct();   cpu_clk -= 4; WRMEM(ea, dec(RDMEM(ea))); break; /* DEC direct */
-      case 0x0c: direct();   cpu_clk -= 4; WRMEM(ea, inc(RDMEM(ea))); break; /* INC direct */
-      case 0x0d: direct();   cpu_clk -= 4;           tst(RDMEM(ea));  break; /* TST direct */
-      case 0x0e: direct();   cpu_clk -= 3;           cPC = ea;         break; /* JMP direct */
-      case 0x0f: direct();   cpu_clk -= 4; WRMEM(ea, clr(RDMEM(ea))); break; /* CLR direct */
-
-      case 0x10:
-      {
-        opcode = imm_byte();
-
-        switch (opcode)
-        {
-          case 0x21:                        cpu_clk -= 5; cPC += 2;                               break;
-          case 0x22:                                      long_branch( cond_HI() );              break;
-          case 0x23:                                      long_branch( cond_LS() );              break;
-          case 0x24:                                      long_branch( cond_HS() );              break;
-          case 0x25:                                      long_branch( cond_LO() );              break;
-          case 0x26:                                      long_branch( cond_NE() );              break;
-          case 0x27:                                      long_branch( cond_EQ() );              break;
-          case 0x28:                                      long_branch( cond_VC() );              break;
-          case 0x29:                                      long_branch( cond_VS() );              break;
-          case 0x2a:                                      long_branch( cond_PL() );              break;
-          case 0x2b:                                      long_branch( cond_MI() );              break;
-          case 0x2c:                                      long_branch( cond_GE() );              break;
-          case 0x2d:                                      long_branch( cond_LT() );              break;
-          case 0x2e:                                      long_branch( cond_GT() );              break;
-          case 0x2f:                                      long_branch( cond_LE() );              break;
-          case 0x3f:                                      swi2();                                break;
-          case 0x83:                        cpu_clk -= 5; cmp16(get_d(),imm_word());             break;
-          case 0x8c:                        cpu_clk -= 5; cmp16(Y,imm_word());                   break;
-          case 0x8e:                        cpu_clk -= 4; Y = ld16(imm_word());                  break;
-          case 0x93:            direct();   cpu_clk -= 5; cmp16(get_d(),RDMEM16(ea)); cpu_clk--; break;
-          case 0x9c:            direct();   cpu_clk -= 5; cmp16(Y, RDMEM16(ea));      cpu_clk--; break;
-          case 0x9e:            direct();   cpu_clk -= 5; Y = ld16(RDMEM16(ea));                 break;
-          case 0x9f:            direct();   cpu_clk -= 5; st16(Y);                               break;
-          case 0xa3: cpu_clk--; indexed();                cmp16(get_d(),RDMEM16(ea)); cpu_clk--; break;
-          case 0xac: cpu_clk--; indexed();                cmp16(Y,RDMEM16(ea));       cpu_clk--; break;
-          case 0xae: cpu_clk--; indexed();                Y = ld16(RDMEM16(ea));                 break;
-          case 0xaf: cpu_clk--; indexed();                st16(Y); break;
-          case 0xb3:            extended(); cpu_clk -= 6; cmp16(get_d(),RDMEM16(ea)); cpu_clk--; break;
-          case 0xbc:            extended(); cpu_clk -= 6; cmp16(Y,RDMEM16(ea));       cpu_clk--; break;
-          case 0xbe:            extended(); cpu_clk -= 6; Y = ld16(RDMEM16(ea));                 break;
-          case 0xbf:            extended(); cpu_clk -= 6; st16(Y); break;
-          case 0xce:                        cpu_clk -= 4; S = ld16(imm_word());                  break;
-          case 0xde:            direct();   cpu_clk -= 5; S = ld16(RDMEM16(ea));                 break;
-          case 0xdf:            direct();   cpu_clk -= 5; st16(S);                               break; 
-          case 0xee: cpu_clk--; indexed();                S = ld16(RDMEM16(ea));                 break;
-          case 0xef: cpu_clk--; indexed();                st16(S);                               break; 
-          case 0xfe:            extended(); cpu_clk -= 6; S = ld16(RDMEM16(ea));                 break;
-          case 0xff:            extended(); cpu_clk -= 6; st16(S);                               break;
-          default:   printf("%X: invalid opcode $10%02X\n",iPC,opcode); monitor_on = 1;          break;
-        }           
-      }
-      break;
-
-      case 0x11:
-      {
-        opcode = imm_byte();
-
-        switch (opcode)
-        {
-          case 0x3f:                                      swi3();                                break;
-          case 0x83:                        cpu_clk -= 5; cmp16(U,imm_word());                   break;
-          case 0x8c:                        cpu_clk -= 5; cmp16(S,imm_word());                   break;
-          case 0x93:            direct();   cpu_clk -= 5; cmp16(U,RDMEM16(ea));       cpu_clk--; break;
-          case 0x9c:            direct();   cpu_clk -= 5; cmp16(S,RDMEM16(ea));       cpu_clk--; break;
-          case 0xa3: cpu_clk--; indexed();                cmp16(U,RDMEM16(ea));       cpu_clk--; break;
-          case 0xac: cpu_clk--; indexed();                cmp16(S,RDMEM16(ea));       cpu_clk--; break;
-          case 0xb3:            extended(); cpu_clk -= 6; cmp16(U,RDMEM16(ea));       cpu_clk--; break;
-          case 0xbc:            extended(); cpu_clk -= 6; cmp16(S,RDMEM16(ea));       cpu_clk--; break;
-          default:   printf("%X: invalid opcode $11%02X\n",iPC,opcode); monitor_on = 1;          break;
-        }
-      }
-      break;
-
-      case 0x12: nop();                    break;
-      case 0x13: sync();                   break;
-      case 0x16: long_bra(); cpu_clk -= 5; break;
-      case 0x17: long_bsr();               break;
-      case 0x19: daa();                    break;
-      case 0x1a: orcc();                   break;
-      case 0x1c: andcc();                  break;
-      case 0x1d: sex();                    break;
-      case 0x1e: exg();                    break;
-      case 0x1f: tfr();                    break;
-
-      case 0x20: bra();               cpu_clk -= 3; break;
-      case 0x21: cPC++;                cpu_clk -= 3; break;
-      case 0x22: branch( cond_HI() );               break;
-      case 0x23: branch( cond_LS() );               break;
-      case 0x24: branch( cond_HS() );               break;
-      case 0x25: branch( cond_LO() );               break;
-      case 0x26: branch( cond_NE() );               break;
-      case 0x27: branch( cond_EQ() );               break;
-      case 0x28: branch( cond_VC() );               break;
-      case 0x29: branch( cond_VS() );               break;
-      case 0x2a: branch( cond_PL() );               break;
-      case 0x2b: branch( cond_MI() );               break;
-      case 0x2c: branch( cond_GE() );               break;
-      case 0x2d: branch( cond_LT() );               break;
-      case 0x2e: branch( cond_GT() );               break;
-      case 0x2f: branch( cond_LE() );               break;
-
-      case 0x30: indexed();                          Z = X = ea;      break; /* LEAX indexed */
-      case 0x31: indexed();                          Z = Y = ea;      break; /* LEAY indexed */
-      case 0x32: indexed();                          S = ea;          break; /* LEAS indexed */
-      case 0x33: indexed();                          U = ea;          break; /* LEAU indexed */
-      case 0x34:                                     pshs();          break; /* PSHS implied */
-      case 0x35:                                     puls();          break; /* PULS implied */
-      case 0x36:                                     pshu();          break; /* PSHU implied */
-      case 0x37:                                     pulu();          break; /* PULU implied */
-      case 0x39:                                     rts();           break; /* RTS implied  */
-      case 0x3a:                                     abx();           break; /* ABX implied  */
-      case 0x3b:                                     rti();           break; /* RTI implied  */
-      case 0x3c:                                     cwai();          break; /* CWAI implied */
-      case 0x3d:                                     mul();           break; /* MUL implied  */
-      case 0x3f:                                     swi();           break; /* SWI implied  */
-
-      case 0x40: A = neg(A); break; /* NEGA implied */
-      case 0x43: A = com(A); break; /* COMA implied */
-      case 0x44: A = lsr(A); break; /* LSRA implied */
-      case 0x46: A = ror(A); break; /* RORA implied */
-      case 0x47: A = asr(A); break; /* ASRA implied */
-      case 0x48: A = asl(A); break; /* ASLA implied */
-      case 0x49: A = rol(A); break; /* ROLA implied */
-      case 0x4a: A = dec(A); break; /* DECA implied */
-      case 0x4c: A = inc(A); break; /* INCA implied */
-      case 0x4d:     tst(A); break; /* TSTA implied */
-      case 0x4f: A = clr(A); break; /* CLRA implied */
-
-      case 0x50: B = neg(B); break; /* NEGB implied */
-      case 0x53: B = com(B); break; /* COMB implied */
-      case 0x54: B = lsr(B); break; /* LSRB implied */
-      case 0x56: B = ror(B); break; /* RORB implied */
-      case 0x57: B = asr(B); break; /* ASRB implied */
-      case 0x58: B = asl(B); break; /* ASLB implied */
-      case 0x59: B = rol(B); break; /* ROLB implied */
-      case 0x5a: B = dec(B); break; /* DECB implied */
-      case 0x5c: B = inc(B); break; /* INCB implied */
-      case 0x5d:     tst(B); break; /* TSTB implied */
-      case 0x5f: B = clr(B); break; /* CLRB implied */
-
-      case 0x60: indexed();                WRMEM(ea, neg(RDMEM(ea))); break; /* NEG indexed */
-      case 0x63: indexed();                WRMEM(ea, com(RDMEM(ea))); break; /* COM indexed */
-      case 0x64: indexed();                WRMEM(ea, lsr(RDMEM(ea))); break; /* LSR indexed */
-      case 0x66: indexed();                WRMEM(ea, ror(RDMEM(ea))); break; /* ROR indexed */
-      case 0x67: indexed();                WRMEM(ea, asr(RDMEM(ea))); break; /* ASR indexed */
-      case 0x68: indexed();                WRMEM(ea, asl(RDMEM(ea))); break; /* ASL indexed */
-      case 0x69: indexed();                WRMEM(ea, rol(RDMEM(ea))); break; /* ROL indexed */
-      case 0x6a: indexed();                WRMEM(ea, dec(RDMEM(ea))); break; /* DEC indexed */
-      case 0x6c: indexed();                WRMEM(ea, inc(RDMEM(ea))); break; /* INC indexed */
-      case 0x6d: indexed();                          tst(RDMEM(ea));  break; /* TST indexed */
-      case 0x6e: indexed();  cpu_clk += 1;           cPC = ea;         break; /* JMP indexed */
-      case 0x6f: indexed();                WRMEM(ea, clr(RDMEM(ea))); break; /* CLR indexed */
-
-      case 0x70: extended(); cpu_clk -= 5; WRMEM(ea, neg(RDMEM(ea))); break; /* NEG extended */
-      case 0x73: extended(); cpu_clk -= 5; WRMEM(ea, com(RDMEM(ea))); break; /* COM extended */
-      case 0x74: extended(); cpu_clk -= 5; WRMEM(ea, lsr(RDMEM(ea))); break; /* LSR extended */
-      case 0x76: extended(); cpu_clk -= 5; WRMEM(ea, ror(RDMEM(ea))); break; /* ROR extended */
-      case 0x77: extended(); cpu_clk -= 5; WRMEM(ea, asr(RDMEM(ea))); break; /* ASR extended */
-      case 0x78: extended(); cpu_clk -= 5; WRMEM(ea, asl(RDMEM(ea))); break; /* ASL extended */
-      case 0x79: extended(); cpu_clk -= 5; WRMEM(ea, rol(RDMEM(ea))); break; /* ROL extended */
-      case 0x7a: extended(); cpu_clk -= 5; WRMEM(ea, dec(RDMEM(ea))); break; /* DEC extended */
-      case 0x7c: extended(); cpu_clk -= 5; WRMEM(ea, inc(RDMEM(ea))); break; /* INC extended */
-      case 0x7d: extended(); cpu_clk -= 5;           tst(RDMEM(ea));  break; /* TST extended */
-      case 0x7e: extended(); cpu_clk -= 4;           cPC = ea;         break; /* JMP extended */
-      case 0x7f: extended(); cpu_clk -= 5; WRMEM(ea, clr(RDMEM(ea))); break; /* CLR extended */
-
-      case 0x80:             cpu_clk -= 2; A = sub(A, imm_byte());    break;
-      case 0x81:             cpu_clk -= 2;     cmp(A, imm_byte());    break;
-      case 0x82:             cpu_clk -= 2; A = sbc(A, imm_byte());    break;
-      case 0x83:             cpu_clk -= 4;     subd(imm_word());      break;
-      case 0x84:             cpu_clk -= 2; A = and(A, imm_byte());    break;
-      case 0x85:             cpu_clk -= 2;     bit(A, imm_byte());    break;
-      case 0x86:             cpu_clk -= 2; A = ld(imm_byte());        break;
-      case 0x88:             cpu_clk -= 2; A = eor(A, imm_byte());    break;
-      case 0x89:             cpu_clk -= 2; A = adc(A, imm_byte());    break;
-      case 0x8a:             cpu_clk -= 2; A = or(A, imm_byte());     break;
-      case 0x8b:             cpu_clk -= 2; A = add(A, imm_byte());    break;
-      case 0x8c:             cpu_clk -= 4;     cmp16(X, imm_word());  break;
-      case 0x8d:                               bsr();                 break;
-      case 0x8e:             cpu_clk -= 3; X = ld16(imm_word());      break;
-
-      case 0x90: direct();   cpu_clk -= 4; A = sub(A, RDMEM(ea));     break;
-      case 0x91: direct();   cpu_clk -= 4;     cmp(A, RDMEM(ea));     break;
-      case 0x92: direct();   cpu_clk -= 4; A = sbc(A, RDMEM(ea));     break;
-      case 0x93: direct();   cpu_clk -= 4;     subd(RDMEM16(ea));     cpu_clk--; break;
-      case 0x94: direct();   cpu_clk -= 4; A = and(A, RDMEM(ea));     break;
-      case 0x95: direct();   cpu_clk -= 4;     bit(A, RDMEM(ea));     break;
-      case 0x96: direct();   cpu_clk -= 4; A = ld(RDMEM(ea));         break;
-      case 0x97: direct();   cpu_clk -= 4;     st(A);                 break;
-      case 0x98: direct();   cpu_clk -= 4; A = eor(A, RDMEM(ea));     break;
-      case 0x99: direct();   cpu_clk -= 4; A = adc(A, RDMEM(ea));     break;
-      case 0x9a: direct();   cpu_clk -= 4; A = or(A, RDMEM(ea));      break;
-      case 0x9b: direct();   cpu_clk -= 4; A = add(A, RDMEM(ea));     break;
-      case 0x9c: direct();   cpu_clk -= 4;     cmp16(X, RDMEM16(ea)); cpu_clk--; break;
-      case 0x9d: direct();   cpu_clk -= 7; jsr();                     break;
-      case 0x9e: direct();   cpu_clk -= 4; X = ld16(RDMEM16(ea));     break;
-      case 0x9f: direct();   cpu_clk -= 4; st16(X);                   break;
-
-      case 0xa0: indexed();                A = sub(A, RDMEM(ea));     break;
-      case 0xa1: indexed();                cmp(A, RDMEM(ea));         break;
-      case 0xa2: indexed();                A = sbc(A, RDMEM(ea));     break;
-      case 0xa3: indexed();                subd(RDMEM16(ea));         cpu_clk--; break;
-      case 0xa4: indexed();                A = and(A, RDMEM(ea));     break;
-      case 0xa5: indexed();                bit(A, RDMEM(ea));         break;
-      case 0xa6: indexed();                A = ld(RDMEM(ea));         break;
-      case 0xa7: indexed();                st(A);                     break;
-      case 0xa8: indexed();                A = eor(A, RDMEM(ea));     break;
-      case 0xa9: indexed();                A = adc(A, RDMEM(ea));     break;
-      case 0xaa: indexed();                A = or(A, RDMEM(ea));      break;
-      case 0xab: indexed();                A = add(A, RDMEM(ea));     break;
-      case 0xac: indexed();                cmp16(X, RDMEM16(ea));     cpu_clk--; break;
-      case 0xad: indexed();  cpu_clk -= 3; jsr();                     break;
-      case 0xae: indexed();                X = ld16(RDMEM16(ea));     break;
-      case 0xaf: indexed();                st16(X);                   break;
-
-      case 0xb0: extended(); cpu_clk -= 5; A = sub(A, RDMEM(ea));     break;
-      case 0xb1: extended(); cpu_clk -= 5;     cmp(A, RDMEM(ea));     break;
-      case 0xb2: extended(); cpu_clk -= 5; A = sbc(A, RDMEM(ea));     break;
-      case 0xb3: extended(); cpu_clk -= 5;     subd(RDMEM16(ea));     cpu_clk--; break;
-      case 0xb4: extended(); cpu_clk -= 5; A = and(A, RDMEM(ea));     break;
-      case 0xb5: extended(); cpu_clk -= 5;     bit(A, RDMEM(ea));     break;
-      case 0xb6: extended(); cpu_clk -= 5; A = ld(RDMEM(ea));         break;
-      case 0xb7: extended(); cpu_clk -= 5;     st(A);                 break;
-      case 0xb8: extended(); cpu_clk -= 5; A = eor(A, RDMEM(ea));     break;
-      case 0xb9: extended(); cpu_clk -= 5; A = adc(A, RDMEM(ea));     break;
-      case 0xba: extended(); cpu_clk -= 5; A = or(A, RDMEM(ea));      break;
-      case 0xbb: extended(); cpu_clk -= 5; A = add(A, RDMEM(ea));     break;
-      case 0xbc: extended(); cpu_clk -= 5;     cmp16(X, RDMEM16(ea)); cpu_clk--; break;
-      case 0xbd: extended(); cpu_clk -= 8; jsr();                     break;
-      case 0xbe: extended(); cpu_clk -= 5; X = ld16(RDMEM16(ea));     break;
-      case 0xbf: extended(); cpu_clk -= 5; st16(X);                   break;
-
-      case 0xc0:             cpu_clk -= 2; B = sub(B, imm_byte());    break;
-      case 0xc1:             cpu_clk -= 2;     cmp(B, imm_byte());    break;
-      case 0xc2:             cpu_clk -= 2; B = sbc(B, imm_byte());    break;
-      case 0xc3:             cpu_clk -= 4;     addd(imm_word());      break;
-      case 0xc4:             cpu_clk -= 2; B = and(B, imm_byte());    break;
-      case 0xc5:             cpu_clk -= 2;     bit(B, imm_byte());    break;
-      case 0xc6:             cpu_clk -= 2; B = ld(imm_byte());        break;
-      case 0xc8:             cpu_clk -= 2; B = eor(B, imm_byte());    break;
-      case 0xc9:             cpu_clk -= 2; B = adc(B, imm_byte());    break;
-      case 0xca:             cpu_clk -= 2; B = or(B, imm_byte());     break;
-      case 0xcb:             cpu_clk -= 2; B = add(B, imm_byte());    break;
-      case 0xcc:             cpu_clk -= 3;     ldd(imm_word());       break;
-      case 0xce:             cpu_clk -= 3; U = ld16(imm_word());      break;
-
-      case 0xd0: direct();   cpu_clk -= 4; B = sub(B, RDMEM(ea));     break;
-      case 0xd1: direct();   cpu_clk -= 4;     cmp(B, RDMEM(ea));     break;
-      case 0xd2: direct();   cpu_clk -= 4; B = sbc(B, RDMEM(ea));     break;
-      case 0xd3: direct();   cpu_clk -= 4;     addd(RDMEM16(ea));     cpu_clk--; break;
-      case 0xd4: direct();   cpu_clk -= 4; B = and(B, RDMEM(ea));     break;
-      case 0xd5: direct();   cpu_clk -= 4;     bit(B, RDMEM(ea));     break;
-      case 0xd6: direct();   cpu_clk -= 4; B = ld(RDMEM(ea));         break;
-      case 0xd7: direct();   cpu_clk -= 4;     st(B);                 break;
-      case 0xd8: direct();   cpu_clk -= 4; B = eor(B, RDMEM(ea));     break;
-      case 0xd9: direct();   cpu_clk -= 4; B = adc(B, RDMEM(ea));     break;
-      case 0xda: direct();   cpu_clk -= 4; B = or(B, RDMEM(ea));      break;
-      case 0xdb: direct();   cpu_clk -= 4; B = add(B, RDMEM(ea));     break;
-      case 0xdc: direct();   cpu_clk -= 4;     ldd(RDMEM16(ea));      break;
-      case 0xdd: direct();   cpu_clk -= 4;     std();                 break;
-      case 0xde: direct();   cpu_clk -= 4; U = ld16(RDMEM16(ea));     break;
-      case 0xdf: direct();   cpu_clk -= 4;     st16(U);               break;
-
-      case 0xe0: indexed();                B = sub(B, RDMEM(ea));     break;
-      case 0xe1: indexed();                cmp(B, RDMEM(ea));         break;
-      case 0xe2: indexed();                B = sbc(B, RDMEM(ea));     break;
-      case 0xe3: indexed();                addd(RDMEM16(ea));         cpu_clk--; break;
-      case 0xe4: indexed();                B = and(B, RDMEM(ea));     break;
-      case 0xe5: indexed();                bit(B, RDMEM(ea));         break;
-      case 0xe6: indexed();                B = ld(RDMEM(ea));         break;
-      case 0xe7: indexed();                st(B);                     break;
-      case 0xe8: indexed();                B = eor(B, RDMEM(ea));     break;
-      case 0xe9: indexed();                B = adc(B, RDMEM(ea));     break;
-      case 0xea: indexed();                B = or(B, RDMEM(ea));      break;
-      case 0xeb: indexed();                B = add(B, RDMEM(ea));     break;
-      case 0xec: indexed();                ldd(RDMEM16(ea));          break;
-      case 0xed: indexed();                std();                     break;
-      case 0xee: indexed();                U = ld16(RDMEM16(ea));     break;
-      case 0xef: indexed();                st16(U);                   break;
-
-      case 0xf0: extended(); cpu_clk -= 5; B = sub(B, RDMEM(ea));     break;
-      case 0xf1: extended(); cpu_clk -= 5;     cmp(B, RDMEM(ea));     break;
-      case 0xf2: extended(); cpu_clk -= 5; B = sbc(B, RDMEM(ea));     break;
-      case 0xf3: extended(); cpu_clk -= 5;     addd(RDMEM16(ea));     cpu_clk--; break;
-      case 0xf4: extended(); cpu_clk -= 5; B = and(B, RDMEM(ea));     break;
-      case 0xf5: extended(); cpu_clk -= 5;     bit(B, RDMEM(ea));     break;
-      case 0xf6: extended(); cpu_clk -= 5; B = ld(RDMEM(ea));         break;
-      case 0xf7: extended(); cpu_clk -= 5;     st(B);                 break;
-      case 0xf8: extended(); cpu_clk -= 5; B = eor(B, RDMEM(ea));     break;
-      case 0xf9: extended(); cpu_clk -= 5; B = adc(B, RDMEM(ea));     break;
-      case 0xfa: extended(); cpu_clk -= 5; B = or(B, RDMEM(ea));      break;
-      case 0xfb: extended(); cpu_clk -= 5; B = add(B, RDMEM(ea));     break;
-      case 0xfc: extended(); cpu_clk -= 5; ldd(RDMEM16(ea));          break;
-      case 0xfd: extended(); cpu_clk -= 5; std();                     break;
-      case 0xfe: extended(); cpu_clk -= 5; U = ld16(RDMEM16(ea));     break;
-      case 0xff: extended(); cpu_clk -= 5; st16(U);                   break;
-
-	default:   printf("%04X: invalid opcode $%02X\n",iPC,opcode); cpu_clk -= 2; 
-          monitor_on = 1;
-          break;
+    // With -c, keep to the wall clock
+    if (cpu_clk <= pace_clk) {
+      pace(cpu_period - cpu_clk);
+      pace_clk = cpu_clk - pace_quantum;
     }
 
-    // If the keyboard has a character and we're
-    // not servicing an IRQ already, do an IRQ.
-    if (kbhit() && ((EFI & I_FLAG)==0)) {
-
-      // Decrement irqdelay. Only do and IRQ if it's zero.
-      // This gives the monitor code some time to drain
-      // the last character read before getting the next one
-      irqdelay--;
-      if (irqdelay==0) {
-        // Stop doing the SYNC if we are doing it
-        if (doing_sync) {
-	  doing_sync=0; cPC++;
-        }
-        irq();
-        irqdelay= 200;
-      }
+    // With -P, charge the cycles since the last sample to this PC.
+    // These are counted from cpu_period, which cpu_idle() can cut.
+    if (cpu_clk <= prof_clk) {
+      prof_sample(cPC, cpu_period - cpu_clk - prof_last);
+      prof_last = cpu_period - cpu_clk;
+      prof_clk = cpu_clk - prof_period;
+    }
+
+    // With -J, run a translated block if there is one here.
+    // Not when the monitor wants to see every instruction.
+    if (use_blocks && inst_count == 0 &&
+				(b = find_block(cPC)) != NULL) {
+      check_irq(run_block(b));
+      continue;
     }
 
+    // Get the decoded instruction and run it.
+    // Look in the fetch map first, as most instructions are
+    // already cached on a mapped page.
+    d = fetchmap[cPC >> 8];
+    if (d == NULL || (d += cPC & 0xff)->fn == NULL)
+      d = fetch_inst(cPC);
+    run_inst(d);
+    check_irq(1);
+
   } while (cpu_clk > 0);
+  if (prof_period) prof_sample(cPC, cpu_period - cpu_clk - prof_last);
+  flush_output();
   reset_terminal_mode();		// Go back to blocking I/O
 
   return cpu_period - cpu_clk;
@@ -1319,6 +1923,7 @@ void cpu_reset (int start_addr, int start_stack)
 {
   X = Y = U = A = B = DP = 0;
   H = N = V = C = 0; Z = 1;
+  lz_op = LZ_NONE;
   EFI = F_FLAG|I_FLAG;
 
   S= start_stack;
@@ -1329,3 +1934,21 @@ void cpu_reset (int start_addr, int start_stack)
     cPC = (memory(0xfffe) << 8) | memory(0xffff);
   save_old_terminal_mode();
 }
+
+/* Save and restore the CPU state for a snapshot */
+void save_cpu (struct snapshot *s)
+{
+  s->x = X; s->y = Y; s->s = S; s->u = U; s->pc = cPC;
+  s->a = A; s->b = B; s->dp = DP; s->cc = get_cc();
+  s->doing_sync = doing_sync;
+  s->irqdelay = irqdelay;
+}
+
+void load_cpu (struct snapshot *s)
+{
+  X = s->x; Y = s->y; S = s->s; U = s->u; cPC = s->pc;
+  A = s->a; B = s->b; DP = s->dp; set_cc(s->cc);
+  doing_sync = s->doing_sync;
+  irqdelay = s->irqdelay;
+  save_old_terminal_mode();
+}
@@ -27,6 +27,8 @@
 #include <unistd.h>
 #include <sys/select.h>
 #include <termios.h>
+#include <stdatomic.h>
+#include <limits.h>
 
 typedef unsigned char UINT8;
 typedef signed char INT8;
@@ -46,19 +48,155 @@ typedef signed int INT32;
 #define V_FLAG 0x02
 #define C_FLAG 0x01
 
-// Memory watchpoints are stored in a linked list of this struct
-struct watchpoint {
-  int addr;
-  struct watchpoint *next;
+// The memory layout: 64 page frames of 8K each, mapped
+// to eight 8K pages, plus 32K of ROM
+#define PAGESIZE 8192
+#define NUMFRAMES  64
+#define NUMPAGES    8
+#define RAMSIZE  (PAGESIZE * NUMFRAMES)
+#define ROMSIZE  (PAGESIZE * (NUMPAGES/2))
+
+// The page descriptor table in memory.c: where each 256-byte
+// page is under the current mapping, and when an access to it
+// needs memory() or set_memory() instead
+struct pagedesc {
+  UINT8 *ptr;				// Host memory for the page
+  int phys;				// Physical address of the page
+  int flags;
+};
+#define PD_NOREAD  1
+#define PD_NOWRITE 2
+#define PD_RWATCH  4			// Page has read watchpoints
+#define PD_WWATCH  8			// Page has write watchpoints
+#define PD_INVALID 16			// Invalid page in user mode: accesses fault
+
+// Page fault causes, as latched at $FEB0
+#define PF_READ  0x01
+#define PF_WRITE 0x02
+#define PF_FETCH 0x04
+
+// Test, set and clear an address in a 64K-bit map
+#define BITTEST(map, addr) ((map)[(addr) >> 3] & (1 << ((addr) & 7)))
+#define BITSET(map, addr)  ((map)[(addr) >> 3] |= (1 << ((addr) & 7)))
+#define BITCLR(map, addr)  ((map)[(addr) >> 3] &= ~(1 << ((addr) & 7)))
+
+// Instruction addressing modes, as seen by the decoder
+enum { M_INH, M_IMM8, M_IMM16, M_DIR, M_EXT, M_IDX, M_REL8, M_REL16 };
+
+// A decoded instruction: its handler, the operand from the
+// instruction bytes (sign-extended for relative branches and
+// indexed offsets), the opcode, its length in bytes, the addressing
+// mode, the indexed post byte and the base number of cycles.
+struct dinst {
+  void (*fn)(struct dinst *);
+  UINT16 operand;
+  UINT16 opcode;
+  UINT8 len;
+  UINT8 mode;
+  UINT8 post;
+  UINT8 cycles;
+};
+
+// A translated basic block for -J: copies of its
+// decoded instructions, the last of which can change the PC
+struct tblock {
+  UINT16 pc;			// Address of the first instruction
+  UINT16 ninst;			// Number of instructions
+  unsigned gen;			// Frame generation when translated
+  struct dinst inst[];
+};
+
+// One instruction in the -t trace ring in itrace.c
+#define IT_KERNEL 0x01			// Flags: in kernel mode,
+#define IT_EA	  0x02			// the instruction has an ea
+struct itent {
+  UINT16 pc, ea;
+  UINT16 x, y, u, s;
+  UINT8 a, b, dp, cc;
+  UINT8 flags, len;
+  UINT8 bytes[6];
+};
+
+// When the CH375 disk image is msync()ed: at exit, at
+// the end of each cpu_execute() period or after every write
+enum { SYNC_EXIT, SYNC_PERIOD, SYNC_WRITE };
+
+// Size of the keyboard input ring buffer in uart.c
+#define CBUFSIZE 4096
+#define NUMUARTS 2			// and the number of UART channels
+
+// A snapshot of the whole machine, as written to a file by
+// snapshot.c. The frames are page-aligned so that a restored
+// snapshot can use them in place from a private mmap of the file.
+#define SNAP_MAGIC "Salmi snapshot v1"
+struct snapshot {
+  char magic[32];
+  int size;				// sizeof(struct snapshot)
+
+  // The CPU
+  unsigned x, y, s, u, pc, a, b, dp, cc;
+  int doing_sync;
+  int irqdelay;
+
+  // The MMU
+  int io_active[4];
+  int rom_mapped[4];
+  int io_idx;
+  int pteval[NUMPAGES];
+  unsigned char hc_reg[6];		// The hypercall copy device
+  unsigned char pf_reg[3];		// The page fault latch
+  int pf_signalled, nmi_pending;
+
+  // The CH375
+  unsigned char ch_status, ch_prevcmd, ch_maxcnt;
+  unsigned char ch_buf[64];
+  unsigned char ch_bufindex;
+  unsigned int ch_bufcnt;
+  int ch_gocount, ch_gotarget;
+  int ch_diskopen;			// Was the disk image open?
+  long ch_diskpos;			// and the position in it
+
+  // The paravirtual disk
+  unsigned char pv_reg[8], pv_status;
+
+  // The RTC
+  unsigned char rtc_reg[128], rtc_index;
+  int rtc_irq;
+  double rtc_time;			// Its time, in seconds since 1970
+
+  // Keyboard input which the 6809 hasn't read yet
+  unsigned termcount[NUMUARTS];
+  unsigned char termbuf[NUMUARTS][CBUFSIZE];
+  unsigned uart_irqmask;			// Channels which raise the IRQ
+
+  UINT8 frames[NUMFRAMES][PAGESIZE] __attribute__((aligned(4096)));
+  UINT8 rom[ROMSIZE];
+};
+
+// The header of the shared memory segment which -E exports
+// the memory in. The layout is described in shm.c.
+#define SHM_MAGIC "Salmi shm v1"
+struct shmhead {
+  char magic[16];
+  UINT32 size;				// Size of the whole segment
+  UINT32 pid;				// The simulator's process id
+  UINT32 pagesize, numframes, numpages, romsize;
+  UINT32 frames_off;			// Offset of frame 0
+  UINT32 rom_off;			// Offset of the ROM
+  UINT32 seq;				// Odd while the mapping changes
+  UINT32 pteval[NUMPAGES];		// The page table entries
+  UINT32 io_active;			// Is the I/O area mapped in?
+  UINT32 rom_mapped;			// Is the 24K ROM mapped in?
 };
 
 /* 6809.c */
 extern int cpu_quit;
+extern int cpu_clk;
+extern int inst_hooks;
 extern int cpu_execute (int);
 extern void cpu_reset (int, int);
 extern void shutdown_fs(void);
 
-extern unsigned kbread(void);
 extern void firq (void);
 
 extern unsigned get_a  (void);
@@ -82,6 +220,24 @@ extern void set_u  (unsigned);
 extern void set_pc (unsigned);
 extern void set_d  (unsigned);
 extern void WRMEM16 (unsigned addr, unsigned data);
+extern void decode_inst (struct dinst *, unsigned);
+extern void save_cpu(struct snapshot *s);
+extern void load_cpu(struct snapshot *s);
+extern int ends_block (struct dinst *);
+extern void set_rtc_clk (void);
+
+/* icache.c */
+extern struct dinst *fetchmap[256];
+extern UINT8 *is_code;
+extern void init_icache(void);
+extern struct dinst *fetch_inst(unsigned pc);
+extern void icache_invalidate(int phys);
+extern void icache_remap(void);
+extern void icache_flush(void);
+extern int use_blocks;
+extern int block_exit;
+extern void init_blocks(void);
+extern struct tblock *find_block(unsigned pc);
 
 /* memory.c */
 extern void init_memory(void);
@@ -90,15 +246,33 @@ extern UINT8 memory(unsigned addr);
 extern void set_memory(unsigned addr, UINT8 data);
 extern void set_initial_memory(unsigned addr, UINT8 data);
 void set_io_active(void);
+extern int code_phys(unsigned addr);
+extern void remap(void);
+extern struct pagedesc pdt[256];
+extern UINT8 *frame[];
+extern int kernel_mode(void);
+extern int page0_frame(void);
+extern int nmi_pending;
+extern void page_fault(unsigned addr, int cause);
+extern void save_memory(struct snapshot *s);
+extern void load_memory(struct snapshot *s);
+extern void export_memory(UINT8 *frames, UINT8 *rom);
 
 /* monitor.c */
 extern int monitor_on;
 extern int do_break;
+extern int inst_count;
 extern int check_break (unsigned);
 extern void monitor_init (int); 
 extern int monitor6809 (void);
 extern int dasm (char *, int);
+extern int dasm_bytes (char *, int, UINT8 *, int);
 extern void add_breakpoint (int break_pc);
+extern void add_watchpoint (int start, int end, int is_read);
+extern UINT8 brkmap[];
+extern UINT8 rwatch[];
+extern UINT8 wwatch[];
+extern UINT8 watchflags[];
 
 extern int load_hex (char *);
 extern int load_s19 (char *);
@@ -108,12 +282,113 @@ extern int load_bin (char *,int);
 extern unsigned char read_ch375_data(void);
 extern unsigned recv_ch375_cmd(unsigned char cmd);
 extern unsigned recv_ch375_data(unsigned char data);
+extern void save_ch375(struct snapshot *s);
+extern int disksync;
+extern void sync_disk(void);
+extern void set_disksync(char *policy);
+extern void load_ch375(struct snapshot *s);
+extern unsigned char read_pvdisk(void);
+extern unsigned recv_pvdisk(unsigned addr, unsigned char data);
+
+/* shm.c */
+extern struct shmhead *shmhead;
+extern void init_shm(char *name);
+
+/* overlay.c */
+extern char *overlayfile;
+extern UINT8 *open_overlay(char *basename, size_t *size);
+extern UINT8 *overlay_read(size_t pos);
+extern UINT8 *overlay_write(size_t pos, size_t len);
+extern void sync_overlay(void);
+extern void commit_overlay(char *name);
+extern void discard_overlay(char *name);
+
+/* snapshot.c */
+extern char *snapfile;
+extern void save_snapshot(char *name);
+extern void load_snapshot(char *name);
+
+/* profile.c */
+enum { PROF_SWI, PROF_SWI2, PROF_SWI3, PROF_IRQ, PROF_FIRQ, PROF_NMI };
+extern int prof_period;
+extern void load_map(char *name);
+extern void init_profile(char *name);
+extern void prof_call(unsigned addr, unsigned sp);
+extern void prof_interrupt(int kind, unsigned sp);
+extern void prof_return(unsigned sp);
+extern void prof_sample(unsigned pc, int cycles);
+
+/* sctrace.c */
+extern int sc_trace;
+extern void init_sctrace(char *name);
+extern void sc_call(unsigned sp);
+extern void sc_return(unsigned sp);
+
+/* itrace.c */
+extern int itrace;
+extern struct itent *itrace_cur;
+extern char *itrace_match;
+extern void init_itrace(char *name);
+extern void set_itrace_match(char *str);
+extern void itrace_inst(struct dinst *d);
+extern void itrace_dump(char *why);
+extern void itrace_putc(unsigned char ch);
+extern void decode_itrace(char *name);
+
+/* ophist.c */
+extern int ophist;
+extern void init_ophist(char *name);
+extern void ophist_inst(struct dinst *d);
+extern void ophist_cycles(struct dinst *d);
+
+/* replay.c */
+extern int recording;
+extern int replaying;
+extern long long replay_at;
+extern void init_record(char *name);
+extern void init_replay(char *name);
+extern void record_irq(long long cycle);
+extern void record_input(unsigned ch);
+extern void replay_input(void);
+
+/* rtc.c */
+extern long long rtc_due;
+extern int rtc_irq;
+extern void init_rtc(void);
+extern void rtc_event(void);
+extern UINT8 read_rtc(void);
+extern void recv_rtc(unsigned addr, UINT8 data);
+extern void save_rtc(struct snapshot *s);
+extern void load_rtc(struct snapshot *s);
+
+/* pace.c */
+extern double pace_hz;
+extern int pace_quantum;
+extern void init_pace(double mhz);
+extern void pace(int cycles);
+extern int pace_skip(int period);
+extern void pace_report(double secs);
 
 /* uart.c */
 extern void reset_terminal_mode(void);
 extern void save_old_terminal_mode(void);
+extern atomic_int input_ready;
 extern int kbhit(void);
-extern unsigned kbread(void);
+extern unsigned uart_read(int n);
+extern unsigned uart_status(void);
+extern void uart_irqmask(unsigned mask);
+extern void kbinject(unsigned char ch);
 extern int ttySetCbreak(void);
+extern void start_input_thread(void);
+extern void pause_input(void);
+extern int wait_for_input(void);
+extern void set_output(char *name);
+extern void set_uart(int n, char *spec);
+extern void init_uart(void);
+extern void flush_output(void);
+extern void uart_write(int n, unsigned char ch);
+extern void resume_input(void);
+extern void save_uart(struct snapshot *s);
+extern void load_uart(struct snapshot *s);
 
 #endif /* M6809_H */
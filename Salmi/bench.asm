@@ -0,0 +1,36 @@
+; A simple CPU benchmark for the simulator. It loops forever,
+; mostly doing 8-bit and 16-bit arithmetic on a small buffer.
+; Run it with a cycle limit to see how fast the simulator is:
+;
+;	make bench.s19
+;	./6809 -l 300000000 bench.s19
+;	./6809 -J -l 300000000 bench.s19
+
+	org	$0100
+
+start	ldx	#buf
+inner	lda	,x		; Lots of flag-setting instructions
+	adda	#$11
+	eora	#$5a
+	anda	#$7f
+	ora	#$01
+	asla
+	rola
+	suba	#$03
+	inca
+	deca
+	tsta
+	sta	,x+
+	ldd	sum		; and some 16-bit ones
+	addd	#$0101
+	subd	#$0010
+	std	sum
+	cmpx	#buf+64
+	bne	inner
+	bra	start
+
+sum	fdb	0
+buf	rmb	64
+
+	org	$fffe		; The reset vector
+	fdb	start
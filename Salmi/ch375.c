@@ -1,12 +1,16 @@
 // Simple simulation of the CH375 USB storage controller.
 // Just enough to read/write blocks from a USB drive image.
+// Also a paravirtual DMA disk which uses the same image.
 // (c) 2023 Warren Toomey, GPL3.
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include "6809.h"
 
 // List of known commands
 #define GET_IC_VER	0x01
@@ -33,25 +37,142 @@
 #define USB_INT_DISK_WRITE	0x1E
 #define USB_INT_DISK_ERR	0x1F
 
+// Paravirtual disk commands
+#define PV_READ			0x01
+#define PV_WRITE		0x02
+
 // Current CH375 status
 // and the previous command
 static unsigned char status = 0;
 static unsigned char prevcmd = 0;
 
-// File which holds the USB disk image
+// File which holds the USB disk image. It is mapped into memory
+// when the 6809 does a DISK_INIT, so that block reads and writes
+// don't need any system calls. diskpos is where the next 64 bytes
+// will be read or written. Written bytes are in the page cache
+// straight away; disksync says when we msync() them to the disk.
+// With -I, the image is a read-only base and overlay.c does the
+// mapping and the syncing. disk is then the base.
 extern char *ch375file;
-static FILE *disk;
+static UINT8 *disk= NULL;
+static size_t disksize;
+static size_t diskpos;
+static size_t dirtylo, dirtyhi;		// Range written since the last msync
+int disksync= SYNC_EXIT;
 
 // We receive and transmit data from this buffer.
 // The index is the position of the next byte to send/receive.
 // The count is the number of bytes remaining to send.
 // The max count is what the 6809 told us it would send.
 static unsigned char buf[64];
+static unsigned char *bufp = buf;	// The data to send, in buf or the disk
 static unsigned char bufindex = 0;
 static unsigned int bufcnt = 0;
 static unsigned char maxcnt = 0;
 
 
+// Map the disk image into memory
+static void map_disk(void) {
+  struct stat S;
+  int fd;
+
+  if (disk != NULL) return;
+  if (overlayfile != NULL) {
+    disk = open_overlay(ch375file, &disksize);
+    return;
+  }
+  if (ch375file == NULL) {
+    fprintf(stderr, "No CH375 disk image, use -i or -I\n"); exit(1);
+  }
+  if ((fd = open(ch375file, O_RDWR)) == -1 || fstat(fd, &S) == -1) {
+    fprintf(stderr, "Unable to open CH375 file '%s' read-write\n", ch375file);
+    exit(1);
+  }
+  disksize = S.st_size;
+  disk = mmap(NULL, disksize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (disk == MAP_FAILED) {
+    fprintf(stderr, "Unable to mmap CH375 file '%s'\n", ch375file); exit(1);
+  }
+  close(fd);
+  dirtylo = disksize; dirtyhi = 0;
+}
+
+// Count of consecutive DISK_RD_GO or DISK_WR_GO commands,
+// and the count which ends the transfer
+int gocount=0;
+static int gotarget=0;
+
+// Move to the block with the number in buf[0] to buf[3]. buf[4]
+// is the number of blocks to transfer, each of which takes eight
+// 64-byte chunks and so eight DISK_RD_GO or DISK_WR_GO commands.
+static void seek_count(char *what) {
+  diskpos = 512 * (buf[0] + (buf[1] << 8) + (buf[2] << 16) + ((size_t)buf[3] << 24));
+  if (buf[4] == 0) {
+    fprintf(stderr, "CH375 asked to %s 0 blocks\n", what); exit(1);
+  }
+  if (diskpos + 512 * buf[4] > disksize) {
+    fprintf(stderr, "CH375 %s error offset %ld count %d\n",
+	    what, (long)diskpos, buf[4]); exit(1);
+  }
+  gocount = 0; gotarget = 8 * buf[4];
+}
+
+// Get the disk data at pos to read
+static inline UINT8 *disk_read(size_t pos) {
+  return (overlayfile ? overlay_read(pos) : &disk[pos]);
+}
+
+// Get the place to write len bytes at pos on the disk,
+// and note that they have been written
+static UINT8 *disk_write(size_t pos, size_t len) {
+  if (overlayfile) return (overlay_write(pos, len));
+  if (pos < dirtylo) dirtylo = pos;
+  if (pos + len > dirtyhi) dirtyhi = pos + len;
+  return (&disk[pos]);
+}
+
+// Send the next 64 bytes from the disk, straight from the mapping
+static void read_chunk(void) {
+  if (diskpos + 64 > disksize) {
+    fprintf(stderr, "CH375 read error offset %ld\n", (long)diskpos); exit(1);
+  }
+  bufp = disk_read(diskpos); diskpos += 64;
+}
+
+// Write the 64 bytes in buf to the disk
+static void write_chunk(void) {
+  if (diskpos + 64 > disksize) {
+    fprintf(stderr, "CH375 write error offset %ld\n", (long)diskpos); exit(1);
+  }
+  memcpy(disk_write(diskpos, 64), buf, 64);
+  if (disksync == SYNC_WRITE) sync_disk();
+  diskpos += 64;
+}
+
+// Write the changed part of the disk image back to the file
+void sync_disk(void) {
+  long pagesize = sysconf(_SC_PAGESIZE);
+  size_t start;
+
+  if (overlayfile) { sync_overlay(); return; }
+  if (disk == NULL || dirtylo >= dirtyhi) return;
+  start = dirtylo & ~(pagesize - 1);
+  if (msync(&disk[start], dirtyhi - start, MS_SYNC) == -1) {
+    fprintf(stderr, "CH375 msync error\n"); exit(1);
+  }
+  dirtylo = disksize; dirtyhi = 0;
+}
+
+// Set the msync() policy from the -F option
+void set_disksync(char *policy) {
+  if (!strcmp(policy, "exit"))        disksync = SYNC_EXIT;
+  else if (!strcmp(policy, "period")) disksync = SYNC_PERIOD;
+  else if (!strcmp(policy, "write"))  disksync = SYNC_WRITE;
+  else {
+    fprintf(stderr, "Unknown disk sync policy '%s'\n", policy); exit(1);
+  }
+}
+
 // Read a byte of data from the CH375 device which
 // is returned in the low 8 bits. If there is no
 // data, abort the simulation.
@@ -79,26 +200,21 @@ unsigned char read_ch375_data(void) {
 
   // Otherwise get the data, update the index and count, and return the data.
   // Once there is no data, go back to awaiting a command.
-  data = buf[bufindex++];
+  data = bufp[bufindex++];
   bufcnt--;
 
   return (data);
 }
 
-// Count of consecutive DISK_RD_GO or DISK_WR_GO commands
-int gocount=0;
-
 // Receive a command from the 6809. If the function returns true,
 // then the 6809 must generate an interrupt.
 unsigned recv_ch375_cmd(unsigned char cmd) {
 
-  struct stat S;
   off_t numblocks;
-  int err;
 
   switch (prevcmd = cmd) {
   case GET_IC_VER:
-    bufindex = 0; bufcnt = 1; buf[0] = 0xB7; status = 0; break;
+    bufp = buf; bufindex = 0; bufcnt = 1; buf[0] = 0xB7; status = 0; break;
   case RESET_ALL:
     bufindex = 0; bufcnt = 0; status = 0; break; break;
   case CHECK_EXIST:
@@ -106,23 +222,16 @@ unsigned recv_ch375_cmd(unsigned char cmd) {
   case SET_USB_MODE:
     bufindex = 0; bufcnt = 0; status = 0; break;
   case DISK_INIT:
-    // Try to open the filesystem image. Send an interrupt if successful
-    if ((disk = fopen(ch375file, "r+")) == NULL) {
-      fprintf(stderr, "Unable to open CH375 file '%s' read-write\n", ch375file);
-      exit(1);
-    }
+    // Map in the filesystem image. Send an interrupt if successful
+    map_disk();
     status = USB_INT_SUCCESS; return (1);
   case GET_STATUS:
     // Nothing to do here
     break;
   case DISK_SIZE:
-    // Get the file's size
-    if (stat(ch375file, &S) == -1) {
-      fprintf(stderr, "CH375 unable to stat '%s'\n", ch375file); exit(1);
-    }
-
-    // Convert to number of blocks
-    numblocks = S.st_size / 512;
+    // Convert the image's size to a number of blocks
+    map_disk();
+    numblocks = disksize / 512;
 
     // Put the 32-bit size into the buffer big-endian
     buf[0] = (numblocks >> 24) & 0xff;
@@ -134,7 +243,7 @@ unsigned recv_ch375_cmd(unsigned char cmd) {
     buf[4] = 0x00; buf[5] = 0x00; buf[6] = 0x02; buf[7] = 0x00;
 
     // Send an interrupt
-    bufindex = 0; bufcnt = 8; status = USB_INT_SUCCESS; return (1);
+    bufp = buf; bufindex = 0; bufcnt = 8; status = USB_INT_SUCCESS; return (1);
   case DISK_READ:
     // Nothing to do here
     gocount=0; bufindex=0; break;
@@ -148,21 +257,20 @@ unsigned recv_ch375_cmd(unsigned char cmd) {
     // Nothing to do here
     break;
   case DISK_RD_GO:
-    // Read another 64 bytes into the buffer and send an interrupt
-    // After eight DISK_RD_GO commands, set status to USB_INT_SUCCESS
-    if ((err = fread(buf, 64, 1, disk)) != 1) {
-      fprintf(stderr, "CH375 read error\n"); exit(1);
-    }
-    bufindex = 0; bufcnt = 64; gocount++;
-    if (gocount==8)
+    // Read another 64 bytes into the buffer and send an interrupt.
+    // Once all the blocks have been sent, set status to USB_INT_SUCCESS
+    gocount++;
+    if (gocount==gotarget)
       status = USB_INT_SUCCESS;
-    else
-      status = USB_INT_DISK_READ;
+    else {
+      read_chunk();
+      bufindex = 0; bufcnt = 64; status = USB_INT_DISK_READ;
+    }
     return (1);
   case DISK_WR_GO:
     // Send an interrupt
     gocount++;
-    if (gocount==8)
+    if (gocount==gotarget)
       status = USB_INT_SUCCESS;
     else
       status = USB_INT_DISK_WRITE;
@@ -178,20 +286,18 @@ unsigned recv_ch375_cmd(unsigned char cmd) {
 // function returns true, then the 6809
 // must generate an interrupt.
 unsigned recv_ch375_data(unsigned char data) {
-  off_t offset;
-  int err;
 
   switch (prevcmd) {
   case CHECK_EXIST:
     // Invert the data and put it in the buf
-    bufindex = 0; bufcnt = 1; buf[0] = ~data; break;
+    bufp = buf; bufindex = 0; bufcnt = 1; buf[0] = ~data; break;
   case SET_USB_MODE:
     // Ensure it's a 6
     if (data != 6) {
       fprintf(stderr, "Didn't get 6 after USB_MODE: 0x%x\n", data); exit(1);
     }
     // Put the status into the buffer and also send an interrupt
-    status = USB_INT_CONNECT; bufindex = 0; bufcnt = 1; buf[0] = status; return(1);
+    status = USB_INT_CONNECT; bufp = buf; bufindex = 0; bufcnt = 1; buf[0] = status; return(1);
   case DISK_READ:
     // Put the data into the buffer unless there's too much
     if (bufindex > 5) {
@@ -199,22 +305,11 @@ unsigned recv_ch375_data(unsigned char data) {
     }
     buf[bufindex++] = data;
 
-    // Read the block if we have the right number of arguments.
-    // Send an interrupt as a result.
+    // Read the first 64 bytes once we have the right number of
+    // arguments. Send an interrupt as a result.
     if (bufindex == 5) {
-      // We can only read one block at a time
-      if (buf[4] != 1) {
-	fprintf(stderr, "CH375 can only read 1 block\n"); exit(1);
-      }
-      offset = 512 * (buf[0] + (buf[1] << 8) + (buf[2] << 16) + (buf[3] << 24));
-      if ((err = fseek(disk, offset, SEEK_SET)) == -1) {
-	fprintf(stderr, "CH375 seek error offset %ld\n", offset); exit(1);
-      }
-
-      if ((err = fread(buf, 64, 1, disk)) != 1) {
-	fprintf(stderr, "CH375 read error offset %ld\n", offset); exit(1);
-      }
-      bufindex = 0;
+      seek_count("read");
+      read_chunk();
       bufindex = 0; bufcnt = 64; status = USB_INT_DISK_READ; return (1);
     }
     break;
@@ -229,16 +324,7 @@ unsigned recv_ch375_data(unsigned char data) {
     // Seek to the specified location.
     // Send an interrupt as a result.
     if (bufindex == 5) {
-      // We can only write one block at a time
-      if (buf[4] != 1) {
-	fprintf(stderr, "CH375 can only write 1 block\n"); exit(1);
-      }
-      offset = 512 * (buf[0] + (buf[1] << 8) + (buf[2] << 16) + (buf[3] << 24));
-// printf("ch375 write to block %ld\n", offset/512);
-      if ((err = fseek(disk, offset, SEEK_SET)) == -1) {
-	fprintf(stderr, "CH375 seek error offset %ld\n", offset); exit(1);
-      }
-
+      seek_count("write");
       bufindex = 0; status = USB_INT_DISK_WRITE; return (1);
     }
     break;
@@ -261,10 +347,7 @@ unsigned recv_ch375_data(unsigned char data) {
     buf[bufindex++] = data;
     // Write the data to the file if we've hit maxcnt
     if (bufindex == maxcnt) {
-      if ((err = fwrite(buf, 64, 1, disk)) != 1) {
-	fprintf(stderr, "CH375 write error\n"); exit(1);
-      }
-      fflush(disk);
+      write_chunk();
       bufindex = 0; maxcnt = 0;
     }
     break;
@@ -274,3 +357,88 @@ unsigned recv_ch375_data(unsigned char data) {
   }
   return (0);
 }
+
+// The paravirtual disk. This isn't on the real board. It shares
+// the disk image with the CH375 but does DMA: the 6809 writes a
+// block number, a physical frame and an offset in it into the
+// registers, then a command. We copy the whole block between the
+// image and the frame, and the 6809 gets one FIRQ at the end.
+//
+//	$FE90-$FE93	Block number, big-endian
+//	$FE94		Frame number
+//	$FE95-$FE96	Offset in the frame, big-endian
+//	$FE97		Write: PV_READ or PV_WRITE. Read: the status
+static UINT8 pvreg[8];
+static UINT8 pvstatus = USB_INT_SUCCESS;
+
+// Read the paravirtual disk's status
+unsigned char read_pvdisk(void) {
+  return (pvstatus);
+}
+
+// Write one of the paravirtual disk's registers. If the
+// function returns true, then the 6809 must generate an FIRQ.
+unsigned recv_pvdisk(unsigned addr, unsigned char data) {
+  size_t pos;
+  unsigned framenum, offset;
+  UINT8 *mem;
+
+  pvreg[addr & 7] = data;
+  if ((addr & 7) != 7) return (0);
+
+  pos = 512 * (((size_t)pvreg[0] << 24) + (pvreg[1] << 16) + (pvreg[2] << 8) + pvreg[3]);
+  framenum = pvreg[4];
+  offset = (pvreg[5] << 8) + pvreg[6];
+  map_disk();
+  if (pos + 512 > disksize) {
+    fprintf(stderr, "PV disk error offset %ld\n", (long)pos); exit(1);
+  }
+  if (framenum >= NUMFRAMES || offset > PAGESIZE - 512) {
+    fprintf(stderr, "PV disk bad frame %d offset 0x%x\n", framenum, offset);
+    exit(1);
+  }
+  mem = &frame[framenum][offset];
+
+  switch (data) {
+  case PV_READ:
+    // Lose any decoded instructions which the block replaces
+    memcpy(mem, disk_read(pos), 512);
+    for (int i = 0; i < 512; i++)
+      icache_invalidate(framenum * PAGESIZE + offset + i);
+    break;
+  case PV_WRITE:
+    memcpy(disk_write(pos, 512), mem, 512);
+    if (disksync == SYNC_WRITE) sync_disk();
+    break;
+  default:
+    fprintf(stderr, "Unknown PV disk command 0x%x\n", data); exit(1);
+  }
+  pvstatus = USB_INT_SUCCESS;
+  return (1);
+}
+
+// Save the CH375 state in a snapshot
+void save_ch375(struct snapshot *s) {
+  s->ch_status = status; s->ch_prevcmd = prevcmd; s->ch_maxcnt = maxcnt;
+  memcpy(s->ch_buf, bufp, sizeof(buf));
+  s->ch_bufindex = bufindex; s->ch_bufcnt = bufcnt;
+  s->ch_gocount = gocount; s->ch_gotarget = gotarget;
+  s->ch_diskopen = (disk != NULL);
+  s->ch_diskpos = diskpos;
+  memcpy(s->pv_reg, pvreg, sizeof(pvreg)); s->pv_status = pvstatus;
+}
+
+// Restore the CH375 state from a snapshot. The disk image
+// should be the one which the snapshot was taken with.
+void load_ch375(struct snapshot *s) {
+  status = s->ch_status; prevcmd = s->ch_prevcmd; maxcnt = s->ch_maxcnt;
+  memcpy(buf, s->ch_buf, sizeof(buf));
+  bufindex = s->ch_bufindex; bufcnt = s->ch_bufcnt;
+  gocount = s->ch_gocount; gotarget = s->ch_gotarget;
+  bufp = buf;
+  if (s->ch_diskopen) {
+    map_disk();
+    diskpos = s->ch_diskpos;
+  }
+  memcpy(pvreg, s->pv_reg, sizeof(pvreg)); pvstatus = s->pv_status;
+}
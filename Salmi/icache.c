@@ -0,0 +1,213 @@
+// Decoded instruction cache.
+// (c) 2023 Warren Toomey, GPL3
+//
+// Decoding an instruction means several calls to memory() and some
+// table lookups, so we keep each decoded instruction and reuse it
+// the next time the PC gets there. There is one entry for every
+// physical byte of RAM and ROM. Because the entries are found by
+// the physical address and not by the virtual address, changing a
+// page table entry doesn't make any of them stale. Only a write to
+// the bytes of an instruction does, and set_memory() tells us
+// about those.
+//
+// Instructions which run off the end of a frame, or which come
+// from an I/O location or an invalid page, are decoded every time.
+//
+// fetchmap[] gives the cache entries for each 256-byte virtual page
+// under the current memory mapping, so that cpu_execute() can find
+// an instruction without going through code_phys(). It is emptied
+// whenever the mapping changes and filled in again as pages are used.
+//
+// With -J, a run of cached instructions which gets executed often
+// is copied into a basic block, ending with the first instruction
+// which can change the PC. cpu_execute() runs a block without
+// looking up each instruction and without the per-instruction
+// breakpoint and interrupt checks. Blocks are also found by the
+// physical address of their first instruction, so they survive
+// PTE remaps. A write to cached code bumps the generation of its
+// frame, which makes all the blocks in the frame stale. That and
+// a change to the memory mapping set block_exit, so a running
+// block stops straight after the instruction which did it. Blocks
+// end before a breakpoint, and setting one flushes the cache, so
+// blocks can still be used while breakpoints are on.
+
+#include "6809.h"
+
+#define NUMBLOCKS (NUMFRAMES + ROMSIZE/PAGESIZE)
+#define MAXBLOCK  32			// Most instructions in a basic block
+#ifndef BLOCK_HOT
+#define BLOCK_HOT 16			// Runs of an address before translating
+#endif
+
+static struct dinst *icache;		// The decoded instructions
+static struct dinst scratch;		// For instructions we don't cache
+static UINT8 block_used[NUMBLOCKS];	// Does a frame have any entries?
+UINT8 *is_code;				// Is a byte part of a cached instruction?
+struct dinst *fetchmap[256];		// Cache entries for each virtual page
+
+int use_blocks=0;			// Are we translating basic blocks?
+int block_exit=0;			// Should a running block stop?
+static struct tblock **blockmap;	// The block at each physical address
+static UINT8 *heat;			// How often each address has been run
+static unsigned blockgen[NUMBLOCKS];	// Generation of each frame's code
+
+// Allocate the cache
+void init_icache(void)
+{
+  icache= (struct dinst *)calloc(RAMSIZE + ROMSIZE, sizeof(struct dinst));
+  if (icache==NULL) {
+    fprintf(stderr, "calloc fail in init_icache()\n"); exit(1);
+  }
+  is_code= (UINT8 *)calloc(RAMSIZE + ROMSIZE, 1);
+  if (is_code==NULL) {
+    fprintf(stderr, "calloc fail in init_icache()\n"); exit(1);
+  }
+}
+
+// Get the decoded instruction at this PC,
+// decoding it if it isn't already cached
+struct dinst *fetch_inst(unsigned pc)
+{
+  struct dinst *d;
+  int phys= code_phys(pc);
+
+  if (phys == -1) {
+    decode_inst(&scratch, pc); return(&scratch);
+  }
+
+  fetchmap[pc >> 8]= &icache[phys - (pc & 0xff)];
+  d= &icache[phys];
+  if (d->fn != NULL) return(d);
+
+  decode_inst(d, pc);
+
+  // The instruction's bytes must be physically contiguous,
+  // otherwise we won't see writes to the last of them. Also
+  // don't cache one which runs into the I/O area, as that
+  // can be mapped in and out under it.
+  if ((pc & (PAGESIZE-1)) + d->len > PAGESIZE ||
+      (pc < 0xfe00 && pc + d->len > 0xfe00) ||
+      code_phys(pc + d->len - 1) != phys + d->len - 1) {
+    scratch= *d; d->fn= NULL; return(&scratch);
+  }
+
+  block_used[phys / PAGESIZE]= 1;
+  memset(&is_code[phys], 1, d->len);
+  return(d);
+}
+
+// The byte at this physical address has been written to.
+// Lose any cached instruction which includes it. Most writes
+// are to data, so is_code lets us get out quickly. We don't
+// clear is_code here as the byte may still be part of another
+// cached instruction.
+void icache_invalidate(int phys)
+{
+  int start;
+
+  if (is_code==NULL || is_code[phys]==0) return;
+  blockgen[phys / PAGESIZE]++;
+  block_exit= 1;
+
+  // Instructions are at most five bytes long
+  // and never cross the start of the frame
+  start= phys - 4;
+  if (start < phys - (phys % PAGESIZE))
+    start= phys - (phys % PAGESIZE);
+
+  for (; start <= phys; start++)
+    icache[start].fn= NULL;
+}
+
+// The memory mapping has changed
+void icache_remap(void)
+{
+  memset(fetchmap, 0, sizeof(fetchmap));
+  block_exit= 1;
+}
+
+// Lose all the cached instructions
+void icache_flush(void)
+{
+  if (icache==NULL) return;
+
+  for (int i=0; i < NUMBLOCKS; i++)
+    if (block_used[i]) {
+      memset(&icache[i * PAGESIZE], 0, PAGESIZE * sizeof(struct dinst));
+      memset(&is_code[i * PAGESIZE], 0, PAGESIZE);
+      block_used[i]= 0;
+      blockgen[i]++;
+    }
+  block_exit= 1;
+}
+
+// Allocate the basic block cache
+void init_blocks(void)
+{
+  blockmap= (struct tblock **)calloc(RAMSIZE + ROMSIZE, sizeof(struct tblock *));
+  heat= (UINT8 *)calloc(RAMSIZE + ROMSIZE, 1);
+  if (blockmap==NULL || heat==NULL) {
+    fprintf(stderr, "calloc fail in init_blocks()\n"); exit(1);
+  }
+  use_blocks= 1;
+}
+
+// Translate the basic block starting at this PC
+static struct tblock *translate_block(unsigned pc, int phys)
+{
+  struct dinst inst[MAXBLOCK];
+  struct dinst *d;
+  struct tblock *b;
+  int n=0;
+
+  while (n < MAXBLOCK) {
+    // Stop at anything we can't cache
+    d= fetch_inst(pc);
+    if (d != &icache[phys]) break;
+    inst[n++]= *d;
+    if (ends_block(d)) break;
+
+    // Stay inside the frame, and stop before the I/O area.
+    // Also stop before a breakpoint, so that check_break() sees it.
+    pc += d->len; phys += d->len;
+    if ((phys % PAGESIZE)==0 || pc >= 0xfe00 || code_phys(pc) != phys) break;
+    if (BITTEST(brkmap, pc)) break;
+  }
+  if (n==0) return(NULL);
+
+  b= (struct tblock *)malloc(sizeof(struct tblock) + n * sizeof(struct dinst));
+  if (b==NULL) {
+    fprintf(stderr, "malloc fail in translate_block()\n"); exit(1);
+  }
+  b->ninst= n;
+  memcpy(b->inst, inst, n * sizeof(struct dinst));
+  return(b);
+}
+
+// Return the translated block starting at this PC. Return NULL
+// if there isn't one yet, and the interpreter should run it.
+struct tblock *find_block(unsigned pc)
+{
+  struct dinst *base= fetchmap[pc >> 8];
+  struct tblock *b;
+  int phys, frame;
+
+  // The interpreter hasn't been on this page since the last remap
+  if (base==NULL) return(NULL);
+
+  phys= base - icache + (pc & 0xff);
+  frame= phys / PAGESIZE;
+  b= blockmap[phys];
+  if (b != NULL && b->pc == pc && b->gen == blockgen[frame]) return(b);
+
+  // Only translate code which gets run often
+  if (heat[phys] < BLOCK_HOT) { heat[phys]++; return(NULL); }
+  heat[phys]= 0;
+
+  free(b);
+  b= blockmap[phys]= translate_block(pc, phys);
+  if (b != NULL) {
+    b->pc= pc; b->gen= blockgen[frame];
+  }
+  return(b);
+}
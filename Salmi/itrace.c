@@ -0,0 +1,152 @@
+// A binary instruction trace ring for post-mortem debugging.
+// (c) 2023 Warren Toomey, GPL3
+//
+// With -t, run_inst() records every instruction in a fixed-size ring
+// in memory: the PC, the instruction bytes, the registers before it
+// runs, the effective address and whether we were in kernel mode.
+// Nothing is formatted while the 6809 runs. The ring is only written
+// out, oldest instruction first, when something goes wrong: at a
+// breakpoint, an invalid opcode, too many stacked or unstacked
+// interrupts, or when the UART prints the -u string, e.g. a panic
+// message. Each dump is appended to the -t file with the reason.
+//
+// The dumps are read back with -X, which uses dasm() from monitor.c
+// on the recorded bytes, so it doesn't need the 6809's memory.
+
+#include "6809.h"
+
+#define ITRACE_SIZE  65536		// Instructions in the ring, a power of 2
+#define ITRACE_MAGIC "Salmi itrace v1"
+
+// The header before each dump in the file
+struct ithead {
+  char magic[16];
+  char why[44];
+  UINT32 count;				// Number of struct itents which follow
+};
+
+int itrace= 0;				// Are we recording instructions?
+struct itent *itrace_cur;		// The one being recorded
+static struct itent *ring;
+static unsigned ring_next;		// Total recorded, mod 2^32
+static char *itrace_file;		// Where the dumps go
+char *itrace_match= NULL;		// Dump when the UART prints this
+static int match_len;			// How much of it we've seen so far
+
+// Record the instruction at cPC before it runs
+void itrace_inst(struct dinst *d)
+{
+  struct itent *e= &ring[ring_next++ & (ITRACE_SIZE-1)];
+  unsigned pc= get_pc();
+
+  e->pc= pc;
+  e->x= get_x(); e->y= get_y(); e->u= get_u(); e->s= get_s();
+  e->a= get_a(); e->b= get_b(); e->dp= get_dp(); e->cc= get_cc();
+  e->flags= kernel_mode() ? IT_KERNEL : 0;
+  if (d->mode == M_DIR || d->mode == M_EXT || d->mode == M_IDX)
+    e->flags |= IT_EA;
+  e->len= (d->len < sizeof(e->bytes)) ? d->len : sizeof(e->bytes);
+  for (int i=0; i < e->len; i++)
+    e->bytes[i]= memory((pc + i) & 0xffff);
+  e->ea= 0;
+  itrace_cur= e;
+}
+
+// Append the ring to the -t file, oldest instruction first
+void itrace_dump(char *why)
+{
+  FILE *out;
+  struct ithead h;
+  unsigned count, first;
+
+  if (!itrace) return;
+  count= (ring_next < ITRACE_SIZE) ? ring_next : ITRACE_SIZE;
+  first= (ring_next - count) & (ITRACE_SIZE-1);
+
+  if ((out= fopen(itrace_file, "a"))==NULL) {
+    fprintf(stderr, "Unable to write trace %s\n", itrace_file); return;
+  }
+  memset(&h, 0, sizeof(h));
+  strcpy(h.magic, ITRACE_MAGIC);
+  strncpy(h.why, why, sizeof(h.why)-1);
+  h.count= count;
+  fwrite(&h, sizeof(h), 1, out);
+
+  // The ring may wrap around its end
+  if (first + count > ITRACE_SIZE) {
+    fwrite(&ring[first], sizeof(struct itent), ITRACE_SIZE - first, out);
+    fwrite(ring, sizeof(struct itent), first + count - ITRACE_SIZE, out);
+  } else
+    fwrite(&ring[first], sizeof(struct itent), count, out);
+  fclose(out);
+  fprintf(stderr, "Dumped %u instructions to %s: %s\n", count, itrace_file, why);
+}
+
+// See if the UART has printed the -u string
+void itrace_putc(unsigned char ch)
+{
+  if (ch != itrace_match[match_len])
+    match_len= (ch == itrace_match[0]);
+  else
+    match_len++;
+  if (itrace_match[match_len] == '\0') {
+    itrace_dump("UART output matched");
+    match_len= 0;
+  }
+}
+
+// Start recording, dumping the ring to the named file
+void init_itrace(char *name)
+{
+  itrace_file= name;
+  ring= (struct itent *)calloc(ITRACE_SIZE, sizeof(struct itent));
+  if (ring==NULL) {
+    fprintf(stderr, "calloc fail in init_itrace()\n"); exit(1);
+  }
+  itrace= inst_hooks= 1;
+}
+
+// Dump the ring when the UART prints this string
+void set_itrace_match(char *str)
+{
+  if (*str == '\0') {
+    fprintf(stderr, "The -u string can't be empty\n"); exit(1);
+  }
+  itrace_match= str;
+}
+
+// Print out the dumps in the named file
+void decode_itrace(char *name)
+{
+  FILE *in;
+  struct ithead h;
+  struct itent e;
+  char inst[80], hex[20];
+  int n;
+
+  if ((in= fopen(name, "r"))==NULL) {
+    fprintf(stderr, "Unable to open %s\n", name); exit(1);
+  }
+  while (fread(&h, sizeof(h), 1, in) == 1) {
+    if (strncmp(h.magic, ITRACE_MAGIC, sizeof(h.magic))) {
+      fprintf(stderr, "%s is not a Salmi trace\n", name); exit(1);
+    }
+    h.why[sizeof(h.why)-1]= '\0';
+    printf("Trace of %u instructions, dumped on %s\n", h.count, h.why);
+    printf("   PC   bytes        instruction       A  B  X    Y    U    S    DP CC EA\n");
+    for (unsigned i=0; i < h.count; i++) {
+      if (fread(&e, sizeof(e), 1, in) != 1) {
+	fprintf(stderr, "%s is truncated\n", name); exit(1);
+      }
+      n= 0; hex[0]= '\0';
+      for (int j=0; j < e.len; j++) n += sprintf(hex + n, "%02X", e.bytes[j]);
+      dasm_bytes(inst, e.pc, e.bytes, e.len);
+      printf("%c %04X %-12s %-17s %02X %02X %04X %04X %04X %04X %02X %02X",
+		(e.flags & IT_KERNEL) ? 'K' : 'U', e.pc, hex, inst,
+		e.a, e.b, e.x, e.y, e.u, e.s, e.dp, e.cc);
+      if (e.flags & IT_EA) printf(" %04X", e.ea);
+      printf("\n");
+    }
+  }
+  fclose(in);
+}
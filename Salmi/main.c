@@ -19,47 +19,75 @@
 */
 
 #include "6809.h"
+#include <time.h>
 
 enum { HEX, S19, BIN };
 
-extern struct watchpoint *watchhead;
-int total = 0;
+long long total = 0;
 char *exename;
-char *ch375file= "unknown";
+char *ch375file= NULL;
 
 // Debug output file
 FILE *debugout= NULL;
 
-// Add a watchpoint to the linked list
-static void add_watchpoint(int addr) {
-  struct watchpoint *this;
-  this=(struct watchpoint *)malloc(sizeof(struct watchpoint));
-  if (this==NULL) {
-    fprintf(stderr, "malloc failed in add_watchpoint\n"); exit(1); 
+// Add watchpoints from a list like "1000,2000-20FF"
+static void add_watchpoints(char *list, int is_read) {
+  char *next;
+  int start, end;
+
+  while (*list) {
+    start= end= strtoul(list, &next, 16);
+    if (*next == '-') end= strtoul(next+1, &next, 16);
+    if (next==list || start > end || end > 0xffff ||
+	(*next != ',' && *next != '\0')) {
+      fprintf(stderr, "Bad watchpoint list: %s\n", list); exit(1);
+    }
+    add_watchpoint(start, end, is_read);
+    list= (*next == ',') ? next+1 : next;
   }
-  this->addr= addr;
-
-  // Prepend to the linked list
-  if (watchhead==NULL)
-    this->next= NULL;
-  else
-    this->next= watchhead;
-  watchhead= this;
 }
 
 static void usage (void)
 {
   printf("Usage: %s <options> s19_filename\n",exename);
+  printf("   or: %s <options> -R snapshot\n",exename);
   printf("Options are:\n");
   printf("-m        - start in the monitor\n");
   printf("-x        - randomise memory contents\n");
+  printf("-J        - translate hot code into basic blocks for speed\n");
   printf("-b   addr - set a breakpoint in hex and run until that address\n");
   printf("-s   addr - set stack start address in hex\n");
   printf("-a   addr - start address in hex (instead of reset vector)\n");
   printf("-i   name - use the named fs image for CH375 block operations\n");
+  printf("-I   name - write to this overlay file, not the fs image, making it if needed\n");
+  printf("-C   name - write the blocks in this overlay into its fs image and exit\n");
+  printf("-D   name - throw away the blocks in this overlay and exit\n");
   printf("-p   name - also load the named s19 image\n");
   printf("-d   name - write debug output to this file\n");
-  printf("-w   addr - stop execution when there is a write to this address\n");
+  printf("-o   name - write the UART output to this file\n");
+  printf("-A   spec - put UART channel A on tty (default), pty, unix:socket,\n");
+  printf("            file:name or none\n");
+  printf("-B   spec - put UART channel B on one of these, none by default\n");
+  printf("-w   list - stop execution when there is a write to these addresses\n");
+  printf("-r   list - stop execution when there is a read from these addresses\n");
+  printf("            (a list is hex addresses or ranges, e.g. 1000,2000-20FF)\n");
+  printf("-l cycles - stop after this many cycles and show the emulation speed\n");
+  printf("-c   MHz  - run at this clock rate in real time, e.g. 14.75\n");
+  printf("-S   name - save a snapshot to this file and exit when first waiting for input\n");
+  printf("-R   name - start from this snapshot\n");
+  printf("-F   when - msync the fs image on exit (default), each period or each write\n");
+  printf("-P   name - profile the 6809, writing folded stacks to this file at exit\n");
+  printf("-M   name - load symbols for the profile from this vlink map file\n");
+  printf("-T   name - trace the XV6 system calls to this file\n");
+  printf("-t   name - keep a ring of the last instructions, dump it to this file\n");
+  printf("            at a breakpoint, invalid opcode or interrupt stack error\n");
+  printf("-u   text - also dump the ring when the UART prints this text\n");
+  printf("-X   name - print out the instruction ring dumps in this file and exit\n");
+  printf("-O   name - write opcode and addressing mode counts as CSV to this file\n");
+  printf("-k   name - record the keyboard input and when it arrives to this file\n");
+  printf("-K   name - replay the keyboard input recorded in this file\n");
+  printf("-E   name - put the RAM, ROM and page table in this POSIX shared memory\n");
+  printf("            segment for other programs to read\n");
   exit (1);
 }
 
@@ -73,6 +101,11 @@ int main (int argc, char *argv[])
   int start_in_monitor=0;
   int start_addr= -1;
   int start_stack= 0xC7FF;		// Nine-E V1. V2 will be $D7FF
+  long long cyclelimit= 0;		// Stop after this many cycles if not 0
+  double mhz= 0;			// Clock rate to pace at if not 0
+  char *restore= NULL;			// Snapshot to start from, if any
+  struct timespec starttime, endtime;
+  double secs;
 
   exename = argv[0];
 
@@ -81,36 +114,68 @@ int main (int argc, char *argv[])
   init_memory();			// Set up the memory and mappings
 
   // Get the options
-  while ((opt = getopt(argc, argv, "mxb:s:a:i:p:d:w:")) != -1) {
+  while ((opt = getopt(argc, argv, "mxJb:s:a:i:p:d:o:w:r:l:c:S:R:F:P:M:T:t:u:X:k:K:O:A:B:I:C:D:E:")) != -1) {
     switch(opt) {
       case 'm': start_in_monitor=1; break;
       case 'x': randomise_mem=1; break;
+      case 'J': init_blocks(); break;
       case 'b': breakpoint= strtoul(optarg,NULL,16); break;
       case 's': start_stack= strtoul(optarg,NULL,16); break;
       case 'a': start_addr= strtoul(optarg,NULL,16); break;
       case 'i': ch375file= optarg; break;
+      case 'I': overlayfile= optarg; break;
+      case 'C': commit_overlay(optarg); exit(0);
+      case 'D': discard_overlay(optarg); exit(0);
+      case 'E': init_shm(optarg); break;
       case 'p': if (load_s19(optarg)) usage(); break;
       case 'd': if ((debugout=fopen(optarg, "w"))==NULL) {
 		  fprintf(stderr, "Unable to open %s\n", optarg); exit(1); 
 		}
 		break;
-      case 'w': add_watchpoint(strtoul(optarg,NULL,16));
+      case 'o': set_output(optarg); break;
+      case 'w': add_watchpoints(optarg, 0); break;
+      case 'r': add_watchpoints(optarg, 1); break;
+      case 'l': cyclelimit= strtoll(optarg,NULL,10); break;
+      case 'c': mhz= strtod(optarg,NULL);
+		if (mhz <= 0) usage();
 		break;
+      case 'S': snapfile= optarg; break;
+      case 'R': restore= optarg; break;
+      case 'F': set_disksync(optarg); break;
+      case 'P': init_profile(optarg); break;
+      case 'M': load_map(optarg); break;
+      case 'T': init_sctrace(optarg); break;
+      case 't': init_itrace(optarg); break;
+      case 'u': set_itrace_match(optarg); break;
+      case 'X': decode_itrace(optarg); exit(0);
+      case 'O': init_ophist(optarg); break;
+      case 'k': init_record(optarg); break;
+      case 'K': init_replay(optarg); break;
+      case 'A': set_uart(0, optarg); break;
+      case 'B': set_uart(1, optarg); break;
     }
   }
 
-  // Randomise memory if required
-  if (randomise_mem)
-    randomise_memory();
-
-  // Get the filename to load
-  if (optind >= argc) usage();
-  name= argv[optind];
-
   cpu_quit = 1;
-
-  // Load the binary
-  if(load_s19(name)) usage();
+  init_uart();
+  atexit(flush_output);			// Don't lose UART output on an error
+  atexit(sync_disk);
+
+  if (restore != NULL) {
+    // Start from a snapshot instead of a binary
+    load_snapshot(restore);
+  } else {
+    // Randomise memory if required
+    if (randomise_mem)
+      randomise_memory();
+
+    // Get the filename to load
+    if (optind >= argc) usage();
+    name= argv[optind];
+
+    // Load the binary
+    if(load_s19(name)) usage();
+  }
 
   monitor_init(start_in_monitor);
 
@@ -121,14 +186,33 @@ int main (int argc, char *argv[])
     do_break = 1;
   }
 
-  cpu_reset(start_addr, start_stack);
+  if (restore == NULL)
+    cpu_reset(start_addr, start_stack);
+  if (!replaying) start_input_thread();
 
+  clock_gettime(CLOCK_MONOTONIC, &starttime);
+  if (mhz) init_pace(mhz);
+  init_rtc();
   do
   {
-    total += cpu_execute (6000000);
-  } while (cpu_quit != 0);
-
-  printf("6809 stopped after %d cycles\n",total);
+    // Don't run past the cycle limit, if there is one
+    if (cyclelimit && cyclelimit - total < 6000000)
+      total += cpu_execute (cyclelimit - total);
+    else
+      total += cpu_execute (6000000);
+    if (disksync == SYNC_PERIOD) sync_disk();
+  } while (cpu_quit != 0 && (cyclelimit==0 || total < cyclelimit));
+  clock_gettime(CLOCK_MONOTONIC, &endtime);
+
+  printf("6809 stopped after %lld cycles\n",total);
+  secs= (endtime.tv_sec - starttime.tv_sec) +
+	(endtime.tv_nsec - starttime.tv_nsec) / 1e9;
+
+  // With a cycle limit, we are probably benchmarking
+  if (cyclelimit)
+    printf("%.3f seconds, %.2f MHz\n", secs, total / secs / 1e6);
+  if (mhz)
+    pace_report(secs);
 
   return 0;
 }
@@ -18,10 +18,6 @@
 // When the 24K ROM is enabled, it is mapped from $2000-$7FFF.
 // The top 256 bytes of memory is always ROM, the same as the $7Fxx ROM range.
 
-#define PAGESIZE 8192
-#define NUMFRAMES  64
-#define NUMPAGES    8
-
 // Externs
 extern unsigned cPC;
 
@@ -37,7 +33,172 @@ struct pagetable {			// The page table
 
 UINT8 *frame[NUMFRAMES];		// The 64 8K frames
 
-UINT8 ROM[PAGESIZE * (NUMPAGES/2)];	// The 32K of ROM (only 24K used)
+static UINT8 romstore[ROMSIZE];		// The 32K of ROM (only 24K used),
+UINT8 *ROM= romstore;			// which -E moves to shared memory
+
+// The hypercall copy device. This isn't on the real board. The
+// 6809 writes the source, destination and count as big-endian
+// words at $FEA0, $FEA2 and $FEA4, then a command at $FEA6. We
+// do the whole copy through the current mapping with the 24K ROM
+// hidden, as rommemcpy() etc. do, and charge HC_SETUP cycles plus
+// HC_PERBYTE for each byte. That is about what a DMA engine doing
+// a read and a write per byte would take; the 6809 loops take 20
+// or more cycles a byte. HC_STRLEN leaves its result in the count.
+#define HC_MEMCPY  1
+#define HC_STRNCPY 2
+#define HC_STRLEN  3
+#define HC_SETUP   20
+#define HC_PERBYTE 2
+static UINT8 hcreg[6];
+
+// The page fault latch. This isn't on the real board, which just
+// sends an NMI. When the 6809 accesses an invalid page in user mode
+// the access is done, then page_fault() latches the cause and the
+// address for the kernel to read at $FEB0-$FEB2 and asks for an NMI.
+// As with pgfault_n in Verilog/mmu_decode.v, only the first fault is
+// signalled until the CPU is back in kernel mode.
+static UINT8 pfreg[3];			// Cause, address high and low
+static int pf_signalled= 0;		// Fault signalled since kernel mode?
+int nmi_pending= 0;			// Does the CPU need to take an NMI?
+
+// The page descriptor table. This says where each 256-byte page of
+// the address space is under the current mapping, so that RDMEM()
+// and WRMEM() can do most accesses with a single indexed load or
+// store. It is rebuilt whenever the mapping changes. The flags say
+// when an access must go through memory() or set_memory(): for the
+// I/O area, for invalid pages in user mode and for writes to ROM.
+// They also say which pages have watchpoints on them.
+struct pagedesc pdt[256];
+
+// With -E, publish the page table and the mapping flags
+// in the shared memory header. See shm.c for seq.
+static void export_mapping(void) {
+  shmhead->seq++;
+  atomic_thread_fence(memory_order_release);
+  for (int i=0; i < NUMPAGES; i++)
+    shmhead->pteval[i]= pte[i].pteval;
+  shmhead->io_active= io_active[io_idx];
+  shmhead->rom_mapped= rom_mapped[io_idx];
+  atomic_thread_fence(memory_order_release);
+  shmhead->seq++;
+}
+
+// Rebuild the page descriptor table after a mapping change
+void remap(void) {
+  struct pagedesc *p= pdt;
+  unsigned addr;
+  int pagenum, framenum;
+
+  if (io_active[io_idx]) pf_signalled= 0;
+
+  for (addr=0; addr < 0x10000; addr += 0x100, p++) {
+    if (addr >= 0xff00 ||
+	(rom_mapped[io_idx] && addr >= 0x2000 && addr < 0x8000)) {
+      p->ptr= &ROM[addr & 0x7fff];
+      p->phys= RAMSIZE + (addr & 0x7fff);
+      p->flags= PD_NOWRITE;
+      continue;
+    }
+
+    if (io_active[io_idx] && addr >= 0xfe00) {
+      p->ptr= NULL; p->phys= -1; p->flags= PD_NOREAD|PD_NOWRITE;
+      continue;
+    }
+
+    pagenum= addr >> 13;
+    framenum= pte[pagenum].pteval & (NUMFRAMES-1);
+    p->ptr= pte[pagenum].frame + (addr & (PAGESIZE-1));
+    p->phys= framenum * PAGESIZE + (addr & (PAGESIZE-1));
+    p->flags= 0;
+    if ((pte[pagenum].pteval & 0x80) && !io_active[io_idx])
+      p->flags= PD_NOREAD|PD_NOWRITE|PD_INVALID;
+  }
+
+  for (pagenum=0; pagenum < 256; pagenum++)
+    pdt[pagenum].flags |= watchflags[pagenum];
+
+  icache_remap();
+  if (shmhead != NULL) export_mapping();
+}
+
+// The CPU has accessed an invalid page in user mode
+void page_fault(unsigned addr, int cause) {
+  if (pf_signalled) return;
+  pf_signalled= 1;
+  pfreg[0]= cause; pfreg[1]= addr >> 8; pfreg[2]= addr & 0xff;
+  nmi_pending= 1;
+  block_exit= 1;			// Take the NMI after this instruction
+}
+
+// Copy count bytes from src to dst using the pdt, so whole
+// runs of plain RAM are done with memmove()
+static void hc_memcpy(unsigned src, unsigned dst, unsigned count) {
+  struct pagedesc *ps, *pd;
+  unsigned len;
+
+  while (count > 0) {
+    len= count;
+    if (len > 0x100 - (src & 0xff)) len= 0x100 - (src & 0xff);
+    if (len > 0x100 - (dst & 0xff)) len= 0x100 - (dst & 0xff);
+    ps= &pdt[src >> 8]; pd= &pdt[dst >> 8];
+    if ((ps->flags & PD_NOREAD)==0 && (pd->flags & PD_NOWRITE)==0) {
+      memmove(pd->ptr + (dst & 0xff), ps->ptr + (src & 0xff), len);
+      for (unsigned i=0; i < len; i++)
+	icache_invalidate(pd->phys + (dst & 0xff) + i);
+    } else {
+      for (unsigned i=0; i < len; i++)
+	set_memory(dst + i, memory(src + i));
+    }
+    src= (src + len) & 0xffff; dst= (dst + len) & 0xffff; count -= len;
+  }
+}
+
+// Do a hypercall copy command
+static void hypercall(UINT8 cmd) {
+  unsigned src= (hcreg[0] << 8) | hcreg[1];
+  unsigned dst= (hcreg[2] << 8) | hcreg[3];
+  unsigned count= (hcreg[4] << 8) | hcreg[5];
+  unsigned n=0;
+  int was_mapped= rom_mapped[io_idx];
+  UINT8 ch;
+
+  rom_mapped[io_idx]= 0;
+  remap();
+  switch (cmd) {
+    case HC_MEMCPY:
+      hc_memcpy(src, dst, count); n= count;
+      break;
+    case HC_STRNCPY:
+      // Stop after copying a NUL. If there isn't
+      // one, put a NUL in the last byte instead
+      for (ch=1; n < count && ch != 0; n++) {
+	ch= memory((src + n) & 0xffff);
+	set_memory((dst + n) & 0xffff, ch);
+      }
+      if (ch != 0 && count > 0) set_memory((dst + count - 1) & 0xffff, 0);
+      break;
+    case HC_STRLEN:
+      while (n < 0xffff && memory((src + n) & 0xffff) != 0) n++;
+      hcreg[4]= n >> 8; hcreg[5]= n & 0xff;
+      break;
+    default:
+      fprintf(stderr, "Unknown hypercall 0x%x PC 0x%04x\n", cmd, get_pc());
+      exit(1);
+  }
+  rom_mapped[io_idx]= was_mapped;
+  remap();
+  cpu_clk -= HC_SETUP + HC_PERBYTE * n;
+}
+
+// Are we in kernel mode, i.e. is the I/O area mapped in?
+int kernel_mode(void) {
+  return(io_active[io_idx]);
+}
+
+// Return the frame at page 0
+int page0_frame(void) {
+  return(pte[0].pteval & (NUMFRAMES-1));
+}
 
 // Set up the initial memory map
 void init_memory(void) {
@@ -61,6 +222,22 @@ void init_memory(void) {
     pte[i].frame= frame[i];
     pte[i].pteval= i;
   }
+
+  init_icache();
+  remap();
+}
+
+// Move the frames and the ROM to this memory, for -E
+void export_memory(UINT8 *frames, UINT8 *rom) {
+  for (int i=0; i < NUMFRAMES; i++) {
+    memcpy(&frames[i * PAGESIZE], frame[i], PAGESIZE);
+    free(frame[i]); frame[i]= &frames[i * PAGESIZE];
+  }
+  memcpy(rom, ROM, ROMSIZE);
+  ROM= rom;
+  for (int i=0; i < NUMPAGES; i++)
+    pte[i].frame= frame[pte[i].pteval & (NUMFRAMES-1)];
+  remap();
 }
 
 // Randomise the contents of RAM in all frames
@@ -68,6 +245,7 @@ void randomise_memory(void) {
   for (int i=0; i < NUMFRAMES; i++)
     for (int j=0; j < PAGESIZE; j++)
       frame[i][j]= (UINT8)rand();
+  icache_flush();
 }
 
 // Read a byte from virtual memory
@@ -80,6 +258,10 @@ UINT8 memory(unsigned addr) {
 	addr, get_pc()); exit(1);
   }
 
+  // Plain RAM and ROM
+  if ((pdt[addr >> 8].flags & PD_NOREAD) == 0)
+    return(pdt[addr >> 8].ptr[addr & 0xff]);
+
 #if 0
   pagenum= addr >> 13;
   printf("%d: %X %X\n", pte[pagenum].pteval,
@@ -95,11 +277,18 @@ UINT8 memory(unsigned addr) {
   if (io_active[io_idx] && addr >= 0xfe00) {
       switch (addr) {
         case 0xfe10:
-          // Read a character from the keyboard.
-          return(kbread());
+        case 0xfe11:
+          // Read a character from UART channel A or B
+          return(uart_read(addr & 1));
+        case 0xfe12:
+          // See which UART channels have input
+          return(uart_status());
         case 0xfe30:
           // Read data from the CH375
           return(read_ch375_data());
+        case 0xfe97:
+          // Read the paravirtual disk's status
+          return(read_pvdisk());
         case 0xfe70:
         case 0xfe71:
         case 0xfe72:
@@ -112,6 +301,18 @@ UINT8 memory(unsigned addr) {
 	  pagenum= addr & (NUMPAGES-1);
 	  val= pte[pagenum].pteval;
 	  return(val);
+        case 0xfea4:
+        case 0xfea5:
+	  // Get the hypercall count, e.g. after HC_STRLEN
+	  return(hcreg[addr & 7]);
+        case 0xfeb0:
+        case 0xfeb1:
+        case 0xfeb2:
+	  // Get the cause and address of the last page fault
+	  return(pfreg[addr & 3]);
+        case 0xfec1:
+	  // Read the selected RTC register
+	  return(read_rtc());
 	default:
 	  fprintf(stderr, "Unknown I/O location read 0x%04x PC 0x%04x\n",
 	addr, get_pc());
@@ -130,14 +331,9 @@ UINT8 memory(unsigned addr) {
   pagenum= addr >> 13;	
   offset= addr & (PAGESIZE-1);
 
-  // Get the byte from the page
+  // Get the byte from the page. If the page is
+  // invalid, the CPU has already seen the fault.
   val= pte[pagenum].frame[offset];
-
-  // If the page is marked invalid, XXX TO FIX
-  if (pte[pagenum].pteval & 0x80) {
-    fprintf(stderr, "invalid page read, addr 0x%04x PC 0x%04x\n", addr, get_pc());
-  }
-
   return(val);
 }
 
@@ -167,10 +363,14 @@ void set_memory(unsigned addr, UINT8 data) {
   // Is I/O active?
   if (io_active[io_idx] && addr >= 0xfe00) {
       switch (addr) {
+        case 0xfe12:
+          // Set which UART channels' input raises the IRQ
+          uart_irqmask(data);
+          return;
         case 0xfe20:
-          // Write a character to the UART, i.e. stdout
-          putchar(data);
-          fflush(stdout);
+        case 0xfe21:
+          // Write a character to UART channel A or B
+          uart_write(addr & 1, data);
           return;
         case 0xfe40:
           // Write a data byte to the CH375.
@@ -182,15 +382,47 @@ void set_memory(unsigned addr, UINT8 data) {
           // If it returns true, do an FIRQ
           if (recv_ch375_cmd(data)) firq();
           return;
+        case 0xfe90:
+        case 0xfe91:
+        case 0xfe92:
+        case 0xfe93:
+        case 0xfe94:
+        case 0xfe95:
+        case 0xfe96:
+        case 0xfe97:
+          // Set a paravirtual disk register. The last
+          // one starts the transfer and we do an FIRQ
+          if (recv_pvdisk(addr, data)) firq();
+          return;
+        case 0xfea0:
+        case 0xfea1:
+        case 0xfea2:
+        case 0xfea3:
+        case 0xfea4:
+        case 0xfea5:
+	  // Set a hypercall register
+	  hcreg[addr & 7]= data;
+	  return;
+        case 0xfea6:
+	  // Do a hypercall
+	  hypercall(data);
+	  return;
+        case 0xfec0:
+        case 0xfec1:
+	  // Select an RTC register, or write to it
+	  recv_rtc(addr, data);
+	  return;
         case 0xfe50:
  	  // Disable the 24K ROM
 // printf("rom unmapped\n");
 	  rom_mapped[io_idx]= 0;
+	  remap();
           return;
         case 0xfe51:
  	  // Enable the 24K ROM
 // printf("rom mapped\n");
 	  rom_mapped[io_idx]= 1;
+	  remap();
           return;
         case 0xfe60:
 // printf("I/O disabled\n");
@@ -199,6 +431,7 @@ void set_memory(unsigned addr, UINT8 data) {
 	  io_idx= 0;
 	  io_active[0]= 0;
 	  rom_mapped[0]= 0;
+	  remap();
 	  return;
         case 0xfe70:
         case 0xfe71:
@@ -214,6 +447,7 @@ void set_memory(unsigned addr, UINT8 data) {
 	  framenum= data & (NUMFRAMES-1);
 	  pte[pagenum].frame= frame[framenum];
 	  pte[pagenum].pteval= data;
+	  remap();
 	  return;
         case 0xfe80:
 	  // Drop back to a previous I/O and 24K ROM mapping
@@ -221,8 +455,10 @@ void set_memory(unsigned addr, UINT8 data) {
 // printf("Moved io_idx down to %d: %d %d\n",
 //	io_idx, io_active[io_idx], rom_mapped[io_idx]);
   	  if (io_idx<0) {
+    	    itrace_dump("too many unstacked interrupts");
     	    fprintf(stderr, "Too many unstacked interrupts!\n"); exit(1);
   	  }
+	  remap();
 	  return;
 	default:
 	  fprintf(stderr, "Unknown I/O location write 0x%04x PC 0x%04x\n",
@@ -244,15 +480,10 @@ void set_memory(unsigned addr, UINT8 data) {
   pagenum= addr >> 13;	
   offset= addr & (PAGESIZE-1);
 
-  // Write the byte to the page
+  // Write the byte to the page and lose any
+  // decoded instructions which used the old value
   pte[pagenum].frame[offset]= data;
-
-  // If the page is marked invalid, XXX TO FIX
-  if (pte[pagenum].pteval & 0x80) {
-    fprintf(stderr, "invalid page write, addr 0x%04x PC 0x%04x\n",
-	addr, get_pc());
-    return;
-  }
+  icache_invalidate((pte[pagenum].pteval & (NUMFRAMES-1)) * PAGESIZE + offset);
 }
 
 // Set up intial memory contents
@@ -266,13 +497,28 @@ void set_initial_memory(unsigned addr, UINT8 data) {
 
   // Write to ROM if the address is $2000-$7FFF or $FF00-$FFFF
   if ((addr >= 0x2000 && addr < 0x8000) || addr >= 0xff00) {
-      ROM[addr & 0x7fff]= data; return;
+      ROM[addr & 0x7fff]= data;
+      icache_invalidate(RAMSIZE + (addr & 0x7fff));
+      return;
   }
 
   // Otherwise place data in RAM
   pagenum= addr >> 13;	
   offset= addr & (PAGESIZE-1);
   pte[pagenum].frame[offset]= data;
+  icache_invalidate((pte[pagenum].pteval & (NUMFRAMES-1)) * PAGESIZE + offset);
+}
+
+// Return the physical location of the byte which memory()
+// would return for this address: RAM frames come first, then
+// the ROM. Return -1 if the byte is not plain memory, i.e. an
+// I/O location or on an invalid page.
+int code_phys(unsigned addr) {
+  struct pagedesc *p= &pdt[(addr >> 8) & 0xff];
+
+  if (p->flags & PD_NOREAD)
+    return(-1);
+  return(p->phys + (addr & 0xff));
 }
 
 // Set kernel mode and make the I/O area and 24K ROM visible
@@ -280,11 +526,59 @@ void set_io_active(void) {
   // Move up to the next position, so we remember the previous settings
   io_idx++;
   if (io_idx==4) {
+    itrace_dump("too many stacked interrupts");
     fprintf(stderr, "Too many stacked interrupts!\n"); exit(1);
   }
   io_active[io_idx] = 1;
   rom_mapped[io_idx]= 1;
+  remap();
 // printf("I/O mapped, ROM unmapped\n");
 // printf("Moved io_idx up to %d: %d %d\n",
 //	io_idx, io_active[io_idx], rom_mapped[io_idx]);
 }
+
+// Save the memory and the MMU state in a snapshot
+void save_memory(struct snapshot *s) {
+  for (int i=0; i < NUMFRAMES; i++)
+    memcpy(s->frames[i], frame[i], PAGESIZE);
+  memcpy(s->rom, ROM, ROMSIZE);
+  for (int i=0; i < 4; i++) {
+    s->io_active[i]= io_active[i];
+    s->rom_mapped[i]= rom_mapped[i];
+  }
+  s->io_idx= io_idx;
+  for (int i=0; i < NUMPAGES; i++)
+    s->pteval[i]= pte[i].pteval;
+  memcpy(s->hc_reg, hcreg, sizeof(hcreg));
+  memcpy(s->pf_reg, pfreg, sizeof(pfreg));
+  s->pf_signalled= pf_signalled;
+  s->nmi_pending= nmi_pending;
+}
+
+// Restore the memory and the MMU state from a snapshot. The frames
+// are used in place, so the snapshot must stay mapped. With -E they
+// are copied into the shared memory instead.
+void load_memory(struct snapshot *s) {
+  for (int i=0; i < NUMFRAMES; i++) {
+    if (shmhead != NULL) {
+      memcpy(frame[i], s->frames[i], PAGESIZE); continue;
+    }
+    free(frame[i]); frame[i]= s->frames[i];
+  }
+  memcpy(ROM, s->rom, ROMSIZE);
+  for (int i=0; i < 4; i++) {
+    io_active[i]= s->io_active[i];
+    rom_mapped[i]= s->rom_mapped[i];
+  }
+  io_idx= s->io_idx;
+  for (int i=0; i < NUMPAGES; i++) {
+    pte[i].pteval= s->pteval[i];
+    pte[i].frame= frame[s->pteval[i] & (NUMFRAMES-1)];
+  }
+  memcpy(hcreg, s->hc_reg, sizeof(hcreg));
+  memcpy(pfreg, s->pf_reg, sizeof(pfreg));
+  icache_flush();
+  remap();
+  pf_signalled= s->pf_signalled;
+  nmi_pending= s->nmi_pending;
+}
@@ -873,8 +873,19 @@ char *off4[] =
  "-8", "-7", "-6", "-5", "-4", "-3", "-2", "-1"
 };
 
-#define RDBYTE (memory(0xffff & pc++))
-#define RDWORD (fetch1=(memory(0xffff & pc++) << 8),fetch1|memory(0xffff & pc++))
+/* dasm_bytes() disassembles these bytes instead of memory */
+static UINT8 *dasm_src;
+static int dasm_srclen;
+
+static UINT8 dasm_fetch (int pc, int opc)
+{
+  if (dasm_src == NULL) return memory(0xffff & pc);
+  pc -= opc & 0xffff;
+  return (pc < dasm_srclen) ? dasm_src[pc] : 0;
+}
+
+#define RDBYTE (dasm_fetch(pc++, opc))
+#define RDWORD (fetch1=(dasm_fetch(pc++, opc) << 8),fetch1|dasm_fetch(pc++, opc))
 
 int dasm (char *buf, int opc)
 { /* returns the number of bytes that compose the current instruction */
@@ -987,6 +998,17 @@ int dasm (char *buf, int opc)
   return pc - opc;
 }
 
+/* Disassemble the len instruction bytes which were at opc */
+int dasm_bytes (char *buf, int opc, UINT8 *bytes, int len)
+{
+  int size;
+
+  dasm_src = bytes; dasm_srclen = len;
+  size = dasm(buf, opc);
+  dasm_src = NULL;
+  return size;
+}
+
 int sizeof_file (FILE *file)
 {
   int size;
@@ -1159,10 +1181,15 @@ int load_bin (char *name,int addr)
 }
 
 
-#define MAX_BREAKS		15
-#define CLEAR_BREAK		0xffffffff
-
-int brkpoints[MAX_BREAKS];
+/* Breakpoints and watchpoints are kept as one bit per address,
+   so checking for them costs the same however many are set.
+   watchflags[] says which 256-byte pages have any watchpoints;
+   the page descriptor table gets these flags, so that only
+   accesses to those pages need to look at the bitmaps. */
+UINT8 brkmap[0x10000/8];
+UINT8 rwatch[0x10000/8];
+UINT8 wwatch[0x10000/8];
+UINT8 watchflags[256];
 
 int inst_count = 0;
 int do_break = 0;
@@ -1236,6 +1263,10 @@ enum cmd_numbers
   CMD_BRKSHOW,
   CMD_BRKOFF,
   CMD_BRKON,
+  CMD_WATCH,
+  CMD_RWATCH,
+  CMD_CLRWATCH,
+  CMD_SNAP,
 
   CMD_QUIT,
   CMD_EXIT,
@@ -1282,6 +1313,10 @@ command_t cmd_table [] =
   { CMD_BRKSHOW, "bshow"   },
   { CMD_BRKOFF,  "boff"    },
   { CMD_BRKON,   "bon"     },
+  { CMD_WATCH,   "watch"   },
+  { CMD_RWATCH,  "rwatch"  },
+  { CMD_CLRWATCH,"cwatch"  },
+  { CMD_SNAP,    "snap"    },
   { CMD_QUIT,    "quit"    },
   { CMD_QUIT,    "q"       },
   { CMD_EXIT,    "exit"    },
@@ -1343,9 +1378,7 @@ static void monitor_signal (int sigtype)
 
 void monitor_init (int start_in_monitor)
 {
-  int tmp;
-
-  for (tmp = 0; tmp < MAX_BREAKS; tmp++) brkpoints[tmp] = CLEAR_BREAK;
+  memset(brkmap, 0, sizeof(brkmap));
   inst_count = do_break = 0;
   monitor_on = start_in_monitor;
   signal(SIGINT, monitor_signal);
@@ -1353,16 +1386,9 @@ void monitor_init (int start_in_monitor)
 
 int check_break (unsigned break_pc)
 {
-  int temp_pc = break_pc & 0xffff;
-
-  if (do_break != 0)
-  {
-    int tmp;
-
-    for (tmp = 0; tmp < MAX_BREAKS; tmp++)
-    {
-      if (temp_pc == brkpoints[tmp]) return 1;
-    }
+  if (do_break != 0 && BITTEST(brkmap, break_pc & 0xffff)) {
+    itrace_dump("breakpoint");
+    return 1;
   }
 
   if (inst_count > 0) if (--inst_count == 0) return 1;
@@ -1370,39 +1396,65 @@ int check_break (unsigned break_pc)
   return 0;
 }
 
+/* Translated blocks stop before a breakpoint, so lose any
+   which were made before this one was set */
 void add_breakpoint (int break_pc)
+{
+  BITSET(brkmap, break_pc);
+  if (use_blocks) icache_flush();
+}
+
+void clear_breakpoint (int break_pc)
+{
+  BITCLR(brkmap, break_pc);
+}
+
+void show_breakpoints (void)
 {
   int tmp;
-  int clear = -1;
 
-  for (tmp = 0; tmp < MAX_BREAKS; tmp++)
+  for (tmp = 0; tmp < 0x10000; tmp++) 
   {
-    if (brkpoints[tmp] == break_pc   ) { clear = -1; break; }
-    if (brkpoints[tmp] == CLEAR_BREAK)   clear = tmp; 
+    if (BITTEST(brkmap, tmp)) printf("%04X \n",tmp);
   }
-
-  if (clear == -1) printf("failed to add breakpoint\n");
-  else brkpoints[clear] = break_pc;
 }
 
-void clear_breakpoint (int break_pc)
+/* Work out the page flags again after the watchpoints change */
+static void update_watchflags (void)
 {
-  int tmp;
+  int page, i;
 
-  for (tmp = 0; tmp < MAX_BREAKS; tmp++) 
+  for (page = 0; page < 256; page++)
   {
-    if (brkpoints[tmp] == break_pc) brkpoints[tmp] = CLEAR_BREAK;
+    watchflags[page] = 0;
+    for (i = page * 32; i < page * 32 + 32; i++)
+    {
+      if (rwatch[i]) watchflags[page] |= PD_RWATCH;
+      if (wwatch[i]) watchflags[page] |= PD_WWATCH;
+    }
   }
+  remap();
 }
 
-void show_breakpoints (void)
+/* Watch reads (if is_read) or writes to the addresses start to end */
+void add_watchpoint (int start, int end, int is_read)
 {
- int tmp;
+  for (; start <= end; start++)
+  {
+    if (is_read) BITSET(rwatch, start);
+    else         BITSET(wwatch, start);
+  }
+  update_watchflags();
+}
 
-  for (tmp = 0; tmp < MAX_BREAKS; tmp++) 
+void clear_watchpoint (int start, int end)
+{
+  for (; start <= end; start++)
   {
-    if (brkpoints[tmp] != CLEAR_BREAK) printf("%04X \n",brkpoints[tmp]);
+    BITCLR(rwatch, start);
+    BITCLR(wwatch, start);
   }
+  update_watchflags();
 }
 
 void cmd_dump (int start, int end)
@@ -1520,6 +1572,10 @@ int monitor6809 (void)
                         puts("bshow                 - show breakpoints         ");
                         puts("boff                  - disable all breakpoints  ");
                         puts("bon                   - enable all breakpoints   ");
+                        puts("watch  start [end]    - stop on writes to addrs  ");
+                        puts("rwatch start [end]    - stop on reads from addrs ");
+                        puts("cwatch start [end]    - clear watchpoints        ");
+                        puts("snap   file           - save a machine snapshot  ");
                         puts("(q)uit                - quit simulator           ");
                         puts("e(x)it                - exit monitor (like go)   ");
                         puts("number formats $hex, @oct, %bin, dec           \n");
@@ -1647,7 +1703,32 @@ int monitor6809 (void)
       case CMD_BRKSHOW: show_breakpoints (); continue;
 
       case CMD_BRKOFF:  puts("break points OFF"); do_break = 0; continue;
-      case CMD_BRKON:   puts("break points ON");  do_break = 1; continue;
+      case CMD_BRKON:   puts("break points ON");  do_break = 1;
+                        if (use_blocks) icache_flush();
+                        continue;
+
+      case CMD_WATCH:
+      case CMD_RWATCH:
+      case CMD_CLRWATCH:
+                        if (arg_count == 2)
+                          arg[2] = arg[1];
+                        if (arg_count < 2 || arg_count > 3)
+                          break;
+                        {
+                          int start = str_getnumber(arg[1]) & 0xffff;
+                          int end = str_getnumber(arg[2]) & 0xffff;
+                          int cmd = get_command(arg[0],cmd_table);
+
+                          if (cmd == CMD_CLRWATCH)
+                            clear_watchpoint(start, end);
+                          else
+                            add_watchpoint(start, end, cmd == CMD_RWATCH);
+                        }
+                        continue;
+      case CMD_SNAP:    if (arg_count != 2) break;
+                        save_snapshot(arg[1]);
+                        continue;
+
       case CMD_QUIT:    cpu_quit = 0; return 1;
       case CMD_EXIT:    return 0;
       default:
@@ -0,0 +1,131 @@
+// Count the instructions and addressing modes which the 6809 runs.
+// (c) 2023 Warren Toomey, GPL3
+//
+// With -O, run_inst() calls ophist_inst() before each instruction
+// and ophist_cycles() after it. We count each opcode, including those
+// on the $10 and $11 pages, each decoder addressing mode and each
+// indexed post byte, along with the cycles they took, separately for
+// kernel and user mode. The cycles taken to enter an interrupt belong
+// to no instruction and are not counted. The cycles are those run,
+// cpu_period - cpu_clk, as cpu_idle() can cut the period short in the
+// middle of the idle loop's branch.
+//
+// At exit the counts are written to the -O file as CSV, with one line
+// for each opcode, mode or post byte which was seen:
+//
+//	table,mode,code,name,count,cycles
+//
+// where table is opcode, addressing or postbyte, mode is kernel or
+// user and the names come from dasm().
+
+#include "6809.h"
+
+extern int cpu_period;
+
+struct opcount {
+  long long count, cycles;
+};
+
+int ophist= 0;				// Are we counting instructions?
+static char *ophist_file;
+static struct opcount ops[2][3][256];	// [kernel][page][opcode]
+static struct opcount modes[2][M_REL16+1];
+static struct opcount posts[2][256];	// Indexed post bytes
+static struct opcount *cur_op, *cur_post;	// Counts for this instruction,
+static int cur_kernel;			// its mode
+static int start_clk;			// and the cycles run before it
+
+static char *modename[]= { "inherent", "immediate8", "immediate16", "direct",
+			   "extended", "indexed", "relative8", "relative16" };
+
+// Count the instruction which is about to run
+void ophist_inst(struct dinst *d)
+{
+  int kernel= cur_kernel= kernel_mode();
+  int page= (d->opcode >> 8) == 0x10 ? 1 : (d->opcode >> 8) == 0x11 ? 2 : 0;
+
+  cur_op= &ops[kernel][page][d->opcode & 0xff];
+  cur_op->count++;
+  modes[kernel][d->mode].count++;
+  cur_post= NULL;
+  if (d->mode == M_IDX) {
+    cur_post= &posts[kernel][d->post];
+    cur_post->count++;
+  }
+  start_clk= cpu_period - cpu_clk;
+}
+
+// Charge the cycles of the instruction which has just run
+void ophist_cycles(struct dinst *d)
+{
+  int cycles= cpu_period - cpu_clk - start_clk;
+
+  cur_op->cycles += cycles;
+  modes[cur_kernel][d->mode].cycles += cycles;
+  if (cur_post != NULL) cur_post->cycles += cycles;
+}
+
+// Get the mnemonic or the indexed operand from
+// the disassembly of these instruction bytes
+static char *dasm_name(UINT8 *bytes, int operand)
+{
+  static char buf[80];
+  char *space;
+
+  dasm_bytes(buf, 0, bytes, 5);
+  space= strchr(buf, ' ');
+  if (space == NULL) return(buf);
+  if (operand) return(space + 1);
+  *space= '\0';
+  return(buf);
+}
+
+// Write out the counts as CSV
+static void write_ophist(void)
+{
+  FILE *out;
+  UINT8 bytes[5];
+  char *mode;
+  unsigned code;
+
+  if ((out= fopen(ophist_file, "w"))==NULL) {
+    fprintf(stderr, "Unable to write %s\n", ophist_file); return;
+  }
+  fprintf(out, "table,mode,code,name,count,cycles\n");
+  for (int kernel=0; kernel < 2; kernel++) {
+    mode= kernel ? "kernel" : "user";
+    for (int page=0; page < 3; page++)
+      for (int op=0; op < 256; op++) {
+	if (ops[kernel][page][op].count == 0) continue;
+	memset(bytes, 0, sizeof(bytes));
+	if (page == 0) bytes[0]= code= op;
+	else {
+	  bytes[0]= 0x0f + page; bytes[1]= op; code= (bytes[0] << 8) | op;
+	}
+	fprintf(out, "opcode,%s,0x%0*X,%s,%lld,%lld\n", mode, page ? 4 : 2,
+		code, dasm_name(bytes, 0), ops[kernel][page][op].count,
+		ops[kernel][page][op].cycles);
+      }
+    for (int m=0; m <= M_REL16; m++)
+      if (modes[kernel][m].count)
+	fprintf(out, "addressing,%s,%d,%s,%lld,%lld\n", mode, m, modename[m],
+		modes[kernel][m].count, modes[kernel][m].cycles);
+    for (int post=0; post < 256; post++) {
+      if (posts[kernel][post].count == 0) continue;
+      memset(bytes, 0, sizeof(bytes));
+      bytes[0]= 0xa6; bytes[1]= post;		// LDA with this post byte
+      fprintf(out, "postbyte,%s,0x%02X,\"%s\",%lld,%lld\n", mode, post,
+		dasm_name(bytes, 1), posts[kernel][post].count,
+		posts[kernel][post].cycles);
+    }
+  }
+  fclose(out);
+}
+
+// Start counting, writing the CSV to the named file at exit
+void init_ophist(char *name)
+{
+  ophist_file= name;
+  ophist= inst_hooks= 1;
+  atexit(write_ophist);
+}
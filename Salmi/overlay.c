@@ -0,0 +1,244 @@
+// Copy-on-write overlay disk images.
+// (c) 2023 Warren Toomey, GPL3
+//
+// With -I, the CH375 and the paravirtual disk don't write to the disk
+// image. It is opened read-only as the base, and each block which is
+// written goes into an overlay file instead. Many emulators can then
+// share one base image, each with its own small overlay. The overlay
+// file is laid out as:
+//
+//	header	 OVL_HDRSIZE bytes: the magic, the base's name and size
+//	bitmap	 one bit per 512-byte block, set when it's in the overlay
+//	blocks	 the blocks, at the same offsets as in the base image
+//
+// with the blocks starting on a page boundary. The file is sparse, so
+// only the blocks which have been written take up space. If it doesn't
+// exist it is made for the -i image, which only costs the header. If
+// there is no -i, the base is the image named in the header.
+//
+// The first write to a block copies it from the base into the overlay
+// and sets its bit, so that the CH375's 64-byte writes keep the rest
+// of the block. Reads come from the overlay if the bit is set.
+//
+// -C commits an overlay: its blocks are written into the base image and
+// the overlay is emptied. Other overlays on the same base may then be
+// out of date. -D discards an overlay's blocks and empties it.
+
+#define _GNU_SOURCE			// For fallocate()
+#include "6809.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#define OVL_MAGIC   "Salmi overlay v1"
+#define OVL_HDRSIZE 4096
+
+struct ovlhead {
+  char magic[32];
+  long long basesize;			// Size of the base image
+  char base[OVL_HDRSIZE - 40];		// and its full path name
+};
+
+char *overlayfile= NULL;		// The -I overlay, if any
+static UINT8 *base;			// The base image, read-only
+static UINT8 *ovl;			// The mapped overlay file,
+static UINT8 *bitmap;			// its bitmap
+static UINT8 *blocks;			// and its blocks
+static size_t ovlsize, basesize;
+static size_t dirtylo, dirtyhi;		// Range of ovl written since the last msync
+
+// The offset of the blocks in an overlay for a base of this size
+static size_t blocks_offset(size_t size)
+{
+  long pagesize = sysconf(_SC_PAGESIZE);
+  size_t end= OVL_HDRSIZE + (size / 512 + 7) / 8;
+
+  return((end + pagesize - 1) & ~(pagesize - 1));
+}
+
+// Make an empty overlay for the named base image
+static void create_overlay(char *name, char *basename)
+{
+  struct ovlhead h;
+  struct stat S;
+  char *path;
+  int fd;
+
+  memset(&h, 0, sizeof(h));
+  if ((path= realpath(basename, NULL)) == NULL || stat(path, &S) == -1) {
+    fprintf(stderr, "Unable to find base image %s\n", basename); exit(1);
+  }
+  if (strlen(path) >= sizeof(h.base)) {
+    fprintf(stderr, "Base image name too long: %s\n", path); exit(1);
+  }
+  strcpy(h.base, path); free(path);
+  strcpy(h.magic, OVL_MAGIC);
+  h.basesize= S.st_size;
+  if ((fd= open(name, O_WRONLY|O_CREAT|O_EXCL, 0644)) == -1 ||
+      write(fd, &h, sizeof(h)) != sizeof(h) ||
+      ftruncate(fd, blocks_offset(h.basesize) + h.basesize) == -1) {
+    fprintf(stderr, "Unable to create overlay %s\n", name); exit(1);
+  }
+  close(fd);
+}
+
+// Map in the named overlay. If it doesn't exist and
+// basename isn't NULL, make it for that base image.
+static struct ovlhead *map_overlay(char *name, char *basename)
+{
+  struct ovlhead *h;
+  struct stat S;
+  int fd;
+
+  if (access(name, F_OK) == -1 && basename != NULL)
+    create_overlay(name, basename);
+  if ((fd= open(name, O_RDWR)) == -1 || fstat(fd, &S) == -1) {
+    fprintf(stderr, "Unable to open overlay %s read-write\n", name); exit(1);
+  }
+  ovlsize= S.st_size;
+  ovl= mmap(NULL, ovlsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ovl == MAP_FAILED) {
+    fprintf(stderr, "Unable to mmap overlay %s\n", name); exit(1);
+  }
+  close(fd);
+
+  h= (struct ovlhead *)ovl;
+  if (ovlsize < OVL_HDRSIZE || strcmp(h->magic, OVL_MAGIC) ||
+      ovlsize != blocks_offset(h->basesize) + h->basesize) {
+    fprintf(stderr, "%s is not a Salmi overlay\n", name); exit(1);
+  }
+  h->base[sizeof(h->base)-1]= '\0';
+  basesize= h->basesize;
+  bitmap= &ovl[OVL_HDRSIZE];
+  blocks= &ovl[blocks_offset(basesize)];
+  dirtylo= ovlsize; dirtyhi= 0;
+  return(h);
+}
+
+// Open the overlay on the base image. Return the mapped
+// base and its size. With no -i image, use the base
+// named in the overlay.
+UINT8 *open_overlay(char *basename, size_t *size)
+{
+  struct ovlhead *h= map_overlay(overlayfile, basename);
+  struct stat S;
+  int fd;
+
+  if (basename == NULL) basename= h->base;
+  if ((fd= open(basename, O_RDONLY)) == -1 || fstat(fd, &S) == -1) {
+    fprintf(stderr, "Unable to open base image %s\n", basename); exit(1);
+  }
+  if (S.st_size != basesize) {
+    fprintf(stderr, "Base image %s is not the size of %s's base\n",
+	basename, overlayfile); exit(1);
+  }
+  base= mmap(NULL, basesize, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Unable to mmap base image %s\n", basename); exit(1);
+  }
+  close(fd);
+  *size= basesize;
+  return(base);
+}
+
+// Is the block in the overlay?
+static inline int in_overlay(size_t blk)
+{
+  return(bitmap[blk >> 3] & (1 << (blk & 7)));
+}
+
+// Get the disk data at pos to read
+UINT8 *overlay_read(size_t pos)
+{
+  return(in_overlay(pos / 512) ? &blocks[pos] : &base[pos]);
+}
+
+// Note that len bytes at offset off in the overlay have been written
+static void ovl_dirty(size_t off, size_t len)
+{
+  if (off < dirtylo) dirtylo= off;
+  if (off + len > dirtyhi) dirtyhi= off + len;
+}
+
+// Get the place for len bytes at pos to be written.
+// Copy in each block the first time it's written.
+UINT8 *overlay_write(size_t pos, size_t len)
+{
+  for (size_t blk= pos / 512; blk <= (pos + len - 1) / 512; blk++) {
+    if (in_overlay(blk)) continue;
+    memcpy(&blocks[blk * 512], &base[blk * 512], 512);
+    bitmap[blk >> 3] |= 1 << (blk & 7);
+    ovl_dirty(&bitmap[blk >> 3] - ovl, 1);
+  }
+  ovl_dirty(&blocks[pos] - ovl, len);
+  return(&blocks[pos]);
+}
+
+// Write the changed part of the overlay back to the file
+void sync_overlay(void)
+{
+  long pagesize = sysconf(_SC_PAGESIZE);
+  size_t start;
+
+  if (ovl == NULL || dirtylo >= dirtyhi) return;
+  start= dirtylo & ~(pagesize - 1);
+  if (msync(&ovl[start], dirtyhi - start, MS_SYNC) == -1) {
+    fprintf(stderr, "Overlay msync error\n"); exit(1);
+  }
+  dirtylo= ovlsize; dirtyhi= 0;
+}
+
+// Empty the mapped overlay and free its blocks' space
+static void empty_overlay(void)
+{
+  int fd;
+
+  memset(bitmap, 0, (basesize / 512 + 7) / 8);
+  if (msync(ovl, ovlsize, MS_SYNC) == -1) {
+    fprintf(stderr, "Overlay msync error\n"); exit(1);
+  }
+  // If we can't punch a hole, the blocks are still unused
+  if ((fd= open(overlayfile, O_RDWR)) != -1) {
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		blocks - ovl, basesize);
+    close(fd);
+  }
+}
+
+// Write the overlay's blocks into its base image and empty it
+void commit_overlay(char *name)
+{
+  struct ovlhead *h;
+  size_t count= 0;
+  int fd;
+
+  overlayfile= name;
+  h= map_overlay(name, NULL);
+  if ((fd= open(h->base, O_WRONLY)) == -1) {
+    fprintf(stderr, "Unable to open base image %s read-write\n", h->base);
+    exit(1);
+  }
+  for (size_t blk= 0; blk < basesize / 512; blk++) {
+    if (!in_overlay(blk)) continue;
+    if (pwrite(fd, &blocks[blk * 512], 512, blk * 512) != 512) {
+      fprintf(stderr, "Write error on base image %s\n", h->base); exit(1);
+    }
+    count++;
+  }
+  if (fsync(fd) == -1) {
+    fprintf(stderr, "Unable to sync base image %s\n", h->base); exit(1);
+  }
+  close(fd);
+  empty_overlay();
+  printf("Committed %zu blocks from %s to %s\n", count, name, h->base);
+}
+
+// Throw away the overlay's blocks
+void discard_overlay(char *name)
+{
+  overlayfile= name;
+  map_overlay(name, NULL);
+  empty_overlay();
+  printf("Discarded the blocks in %s\n", name);
+}
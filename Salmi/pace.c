@@ -0,0 +1,84 @@
+// Real-time pacing, so that the simulator runs at the
+// speed of a real board instead of flat out.
+// (c) 2023 Warren Toomey, GPL3
+//
+// With -c, cpu_execute() calls pace() every pace_quantum cycles,
+// about once a millisecond. We work out when the wall clock should
+// reach that cycle and sleep until then. If we are running late by
+// more than PACE_SLACK, we can't catch up without running in a
+// burst, so the schedule is moved along and the time is recorded
+// as lost. Idle time and time in the monitor don't count as lost.
+
+#include "6809.h"
+#include <time.h>
+
+#define PACE_SLACK 0.02			// Seconds late before we give up
+
+extern long long total;			// Cycles run in earlier periods
+double pace_hz= 0;			// Target clock rate, 0 if not pacing
+int pace_quantum= 0;			// Cycles between calls to pace()
+static double pace_base;		// Wall time when cycle 0 was due
+static double pace_lost= 0;		// Seconds we couldn't keep up
+static double pace_maxlate= 0;		// Most we were late by, in seconds
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+// Start pacing at this many MHz
+void init_pace(double mhz)
+{
+  pace_hz= mhz * 1e6;
+  pace_quantum= pace_hz / 1000;
+  if (pace_quantum < 1) pace_quantum= 1;
+  pace_base= now();
+}
+
+// The CPU has run this many cycles of the current period.
+// Sleep until the wall clock catches up with it.
+void pace(int cycles)
+{
+  double due= pace_base + (total + cycles) / pace_hz;
+  double late= now() - due;
+  struct timespec ts;
+
+  if (late > pace_maxlate) pace_maxlate= late;
+  if (late > PACE_SLACK) {
+    pace_base += late; pace_lost += late; return;
+  }
+  if (late >= 0) return;
+
+  ts.tv_sec= (time_t)due;
+  ts.tv_nsec= (due - ts.tv_sec) * 1e9;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+    ;
+}
+
+// The CPU has been idle or in the monitor. Return how many cycles
+// of the current period the wall clock has got to, at most period.
+// If it has gone past the end of the period, move the schedule along
+// so that the wall clock is at the end of it.
+int pace_skip(int period)
+{
+  double cycles= (now() - pace_base) * pace_hz - total;
+
+  if (cycles > period) {
+    pace_base += (cycles - period) / pace_hz;
+    return(period);
+  }
+  return(cycles < 0 ? 0 : (int)cycles);
+}
+
+// Print out how well we kept to the target clock rate
+void pace_report(double secs)
+{
+  printf("Paced at %.3f MHz for a target of %.3f MHz\n",
+	 total / secs / 1e6, pace_hz / 1e6);
+  printf("Drift %+.3f ms, late by up to %.3f ms, %.3f seconds lost\n",
+	 (now() - pace_base - total / pace_hz) * 1000,
+	 pace_maxlate * 1000, pace_lost);
+}
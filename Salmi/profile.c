@@ -0,0 +1,317 @@
+// A sampling profiler for the 6809.
+// (c) 2023 Warren Toomey, GPL3
+//
+// With -P, cpu_execute() calls prof_sample() about every PROF_PERIOD
+// cycles and the cycles since the last sample are charged to the PC
+// and to the current call stack. We keep the call stack ourselves:
+// JSR, BSR and LBSR push the address called, SWIs and interrupts push
+// a marker, and RTS, PULS PC and RTI pop everything which was pushed
+// below the new stack pointer. That copes with code which leaves the
+// stack some other way, as the frames go at the next return.
+//
+// The kernel runs on the stack of the process which called it and
+// the processes all use the same virtual addresses, so there is one
+// call stack for each page-0 frame, i.e. for each process. In user
+// mode we use the frame at page 0. In kernel mode, page 0 is the
+// kernel data, so we stay with the process which was last in user
+// mode. Before the first process, everything goes on frame 0.
+//
+// Symbols come from the vlink map files given with -M. A map with
+// code below $2000 is for a user program, and the rest are for the
+// ROM. PCs in ROM are looked up in the ROM symbols and other PCs in
+// the user symbols, merged from all the user maps. So only give the
+// maps of the programs which you want to look at.
+//
+// At exit we write the samples to the -P file as folded stacks for
+// flamegraph.pl, one line for each stack with the cycles spent in
+// it. The root of each stack is the process' frame and the kernel's
+// functions end in _[k]. We also print the PROF_TOPN functions
+// which took the most cycles.
+
+#include "6809.h"
+
+#define PROF_PERIOD 4096		// Cycles between samples
+#define PROF_DEPTH  64			// Deepest call stack we keep
+#define PROF_TOPN   20			// Functions in the flat report
+
+int prof_period= 0;			// Cycles between samples, 0 if off
+static char *prof_file;			// Where the folded stacks go
+
+struct symbol {
+  unsigned addr;
+  char *name;
+};
+
+struct symtab {
+  struct symbol *sym;
+  int count;
+};
+
+static struct symtab romsyms, usersyms;
+
+// One frame of a call stack: the address called or
+// the kind of interrupt, and the S after the call
+struct pframe {
+  int addr;				// -1 - PROF_xxx for an interrupt
+  unsigned sp;
+  int rom;				// Is the address in ROM?
+};
+
+struct pstack {
+  int depth;
+  struct pframe f[PROF_DEPTH];
+};
+
+static struct pstack pstack[NUMFRAMES];
+static int prof_proc= 0;		// Process whose stack we are on
+
+static char *intname[]= { "[swi]", "[swi2]", "[swi3]", "[irq]", "[firq]",
+			  "[nmi]" };
+
+// Cycles for each PC, in RAM or in ROM
+static long long flat[2][0x10000];
+
+// The folded stacks, in a hash table
+struct folded {
+  char *stack;
+  long long cycles;
+};
+
+static struct folded *fold;
+static unsigned foldsize, foldused;
+
+static int cmp_symbol(const void *a, const void *b)
+{
+  const struct symbol *x= a, *y= b;
+  return(x->addr < y->addr ? -1 : x->addr > y->addr);
+}
+
+// Load the code symbols from a vlink map file
+void load_map(char *name)
+{
+  FILE *in;
+  char line[512], sym[256];
+  unsigned addr;
+  struct symbol *s= NULL;
+  struct symtab *t;
+  int count= 0, user= 0;
+
+  if ((in= fopen(name, "r"))==NULL) {
+    fprintf(stderr, "Unable to open map file %s\n", name); exit(1);
+  }
+  while (fgets(line, sizeof(line), in) != NULL) {
+    if (strstr(line, "Symbols of .data") != NULL) break;
+    if (sscanf(line, " 0x%x %255[^:]:", &addr, sym) != 2) continue;
+    s= (struct symbol *)realloc(s, (count+1) * sizeof(struct symbol));
+    if (s==NULL || (s[count].name= strdup(sym))==NULL) {
+      fprintf(stderr, "malloc fail in load_map()\n"); exit(1);
+    }
+    s[count++].addr= addr & 0xffff;
+    if (addr < 0x2000) user= 1;
+  }
+  fclose(in);
+
+  t= user ? &usersyms : &romsyms;
+  t->sym= (struct symbol *)realloc(t->sym,
+			(t->count + count) * sizeof(struct symbol));
+  if (t->sym==NULL) {
+    fprintf(stderr, "malloc fail in load_map()\n"); exit(1);
+  }
+  memcpy(&t->sym[t->count], s, count * sizeof(struct symbol));
+  t->count += count;
+  qsort(t->sym, t->count, sizeof(struct symbol), cmp_symbol);
+  free(s);
+}
+
+// Return the symbol at or below the address, or NULL
+static struct symbol *find_symbol(unsigned addr, int rom)
+{
+  struct symtab *t= rom ? &romsyms : &usersyms;
+  int lo= 0, hi= t->count - 1, mid;
+
+  if (t->count==0 || addr < t->sym[0].addr) return(NULL);
+  while (lo < hi) {
+    mid= (lo + hi + 1) / 2;
+    if (t->sym[mid].addr <= addr) lo= mid;
+    else hi= mid - 1;
+  }
+  return(&t->sym[lo]);
+}
+
+// Append the name of the function at addr to the string
+static char *add_name(char *p, unsigned addr, int rom)
+{
+  struct symbol *s= find_symbol(addr, rom);
+
+  if (s != NULL) p += sprintf(p, ";%s", s->name);
+  else p += sprintf(p, ";0x%04X", addr);
+  if (rom) p += sprintf(p, "_[k]");
+  return(p);
+}
+
+// Get the call stack of the running process
+static struct pstack *cur_stack(void)
+{
+  if (!kernel_mode()) prof_proc= page0_frame();
+  return(&pstack[prof_proc]);
+}
+
+static void push_frame(int addr, unsigned sp)
+{
+  struct pstack *p= cur_stack();
+
+  // If it is too deep, lose the oldest half
+  if (p->depth == PROF_DEPTH) {
+    memmove(p->f, &p->f[PROF_DEPTH/2], (PROF_DEPTH/2) * sizeof(struct pframe));
+    p->depth= PROF_DEPTH/2;
+  }
+  p->f[p->depth].addr= addr;
+  p->f[p->depth].sp= sp;
+  p->f[p->depth].rom= (addr >= 0 && code_phys(addr) >= RAMSIZE);
+  p->depth++;
+}
+
+// There has been a call to addr, and S is now sp
+void prof_call(unsigned addr, unsigned sp)
+{
+  push_frame(addr, sp);
+}
+
+// There has been an interrupt of this kind, and S is now sp.
+// This is called before the I/O area is mapped in, so we
+// can still see if it interrupted a user process.
+void prof_interrupt(int kind, unsigned sp)
+{
+  push_frame(-1 - kind, sp);
+}
+
+// There has been a return, and S is now sp
+void prof_return(unsigned sp)
+{
+  struct pstack *p= cur_stack();
+
+  while (p->depth > 0 && p->f[p->depth - 1].sp < sp)
+    p->depth--;
+}
+
+// Add cycles to the count for this folded stack
+static void add_folded(char *stack, long long cycles)
+{
+  unsigned h= 2166136261u, i;
+  struct folded *old;
+
+  // Grow the table when it is over half full
+  if (foldused * 2 >= foldsize) {
+    old= fold; i= foldsize;
+    foldsize= foldsize ? foldsize * 2 : 4096;
+    fold= (struct folded *)calloc(foldsize, sizeof(struct folded));
+    if (fold==NULL) {
+      fprintf(stderr, "calloc fail in add_folded()\n"); exit(1);
+    }
+    foldused= 0;
+    while (i-- > 0)
+      if (old[i].stack != NULL) {
+	add_folded(old[i].stack, old[i].cycles); free(old[i].stack);
+      }
+    free(old);
+  }
+
+  for (char *p= stack; *p; p++)
+    h= (h ^ (UINT8)*p) * 16777619;
+  for (i= h & (foldsize-1); fold[i].stack != NULL; i= (i+1) & (foldsize-1))
+    if (!strcmp(fold[i].stack, stack)) {
+      fold[i].cycles += cycles; return;
+    }
+  if ((fold[i].stack= strdup(stack))==NULL) {
+    fprintf(stderr, "malloc fail in add_folded()\n"); exit(1);
+  }
+  fold[i].cycles= cycles;
+  foldused++;
+}
+
+// Charge these cycles to the PC and the current call stack
+void prof_sample(unsigned pc, int cycles)
+{
+  struct pstack *ps= cur_stack();
+  struct pframe *f;
+  struct symbol *leaf, *top;
+  char stack[(PROF_DEPTH + 2) * 264], *p= stack;
+  int rom= (code_phys(pc) >= RAMSIZE);
+
+  flat[rom][pc] += cycles;
+
+  p += sprintf(p, "frame%d", prof_proc);
+  for (int i=0; i < ps->depth; i++) {
+    f= &ps->f[i];
+    if (f->addr < 0) p += sprintf(p, ";%s", intname[-1 - f->addr]);
+    else p= add_name(p, f->addr, f->rom);
+  }
+
+  // Add the function which the PC is in, unless it is
+  // the one which was called. It won't be after a JMP.
+  leaf= find_symbol(pc, rom);
+  f= ps->depth ? &ps->f[ps->depth - 1] : NULL;
+  top= (f != NULL && f->addr >= 0) ? find_symbol(f->addr, f->rom) : NULL;
+  if (f==NULL || f->addr < 0 || f->rom != rom || leaf==NULL || leaf != top)
+    add_name(p, pc, rom);
+
+  add_folded(stack, cycles);
+}
+
+static int cmp_cycles(const void *a, const void *b)
+{
+  const struct folded *x= a, *y= b;
+  return(x->cycles < y->cycles ? 1 : x->cycles > y->cycles ? -1 : 0);
+}
+
+// Write the folded stacks and print the flat report
+static void write_profile(void)
+{
+  FILE *out;
+  struct folded *top;
+  struct symbol *s;
+  char name[300];
+  long long total=0;
+  int n=0;
+
+  if ((out= fopen(prof_file, "w"))==NULL) {
+    fprintf(stderr, "Unable to write profile %s\n", prof_file); return;
+  }
+  for (unsigned i=0; i < foldsize; i++)
+    if (fold[i].stack != NULL)
+      fprintf(out, "%s %lld\n", fold[i].stack, fold[i].cycles);
+  fclose(out);
+
+  // Total the cycles for each function. Reuse the hash table.
+  for (unsigned i=0; i < foldsize; i++) free(fold[i].stack);
+  free(fold); fold= NULL; foldsize= foldused= 0;
+  for (int rom=0; rom < 2; rom++)
+    for (unsigned pc=0; pc < 0x10000; pc++) {
+      if (flat[rom][pc]==0) continue;
+      s= find_symbol(pc, rom);
+      if (s != NULL) sprintf(name, "%s%s", s->name, rom ? " [k]" : "");
+      else strcpy(name, rom ? "[unknown kernel]" : "[unknown user]");
+      add_folded(name, flat[rom][pc]);
+      total += flat[rom][pc];
+    }
+
+  top= (struct folded *)malloc((foldused+1) * sizeof(struct folded));
+  if (top==NULL) return;
+  for (unsigned i=0; i < foldsize; i++)
+    if (fold[i].stack != NULL) top[n++]= fold[i];
+  qsort(top, n, sizeof(struct folded), cmp_cycles);
+
+  printf("Profile of %lld cycles written to %s\n", total, prof_file);
+  for (int i=0; i < n && i < PROF_TOPN; i++)
+    printf("%6.2f%% %14lld  %s\n", 100.0 * top[i].cycles / total,
+				  top[i].cycles, top[i].stack);
+  free(top);
+}
+
+// Start profiling, writing the folded stacks to the named file
+void init_profile(char *name)
+{
+  prof_file= name;
+  prof_period= PROF_PERIOD;
+  atexit(write_profile);
+}
@@ -0,0 +1,96 @@
+// Record and replay the keyboard input.
+// (c) 2023 Warren Toomey, GPL3
+//
+// Keyboard input normally arrives whenever the host delivers it, so
+// no two runs of an interactive program take the same cycles. With
+// -k, each character is logged when the 6809 reads it, with the cycle
+// count at which the IRQ before the read was raised. The RTC shares
+// the IRQ line, so this can be a tick whose handler also reads the
+// UART; logging at the read means that each character is logged once,
+// however many IRQs it was waiting for. With -K, the input thread isn't started and check_irq()
+// puts each logged character into the keyboard ring at its cycle and
+// raises the IRQ there and then. Given the same ROM, disk image and
+// options, the 6809 then does exactly what it did when the input was
+// recorded, so the cycle counts of two kernels can be compared.
+//
+// When the CPU goes idle the cycles which it waits for aren't counted,
+// but it then spins until the IRQ. So in a replay cpu_idle() just lets
+// it spin until the next character is due, and the replay ends like
+// the input does: when the 6809 is idle and there is no more to come.
+// Time spent waiting with -c is counted, so only unpaced recordings
+// replay exactly.
+//
+// The log is text, one line per character: the cycle count then the
+// character in decimal. Only UART channel A is recorded, and with
+// -K there is no input on channel B.
+
+#include "6809.h"
+
+int recording= 0;			// Are we logging the input?
+int replaying= 0;			// Is the input coming from a log?
+long long replay_at= LLONG_MAX;		// Cycle count of the next character
+static int replay_ch;			// and the character
+static FILE *recfile;			// The log we are writing
+static FILE *playfile;			// The log we are replaying
+static char *playname;
+static long long irq_cycle= 0;		// Cycle count of the last IRQ
+
+// Note the cycle count at which the IRQ is being raised
+void record_irq(long long cycle)
+{
+  irq_cycle= cycle;
+}
+
+// Log a character which the 6809 has read from channel A
+void record_input(unsigned ch)
+{
+  fprintf(recfile, "%lld %u\n", irq_cycle, ch);
+}
+
+// Read the next character from the log
+static void replay_next(void)
+{
+  char line[80];
+  long long cycle;
+  int ch;
+
+  while (fgets(line, sizeof(line), playfile) != NULL) {
+    if (line[0] == '#' || line[0] == '\n') continue;
+    if (sscanf(line, "%lld %d", &cycle, &ch) != 2 || ch < 0 || ch > 255 ||
+	cycle < replay_at) {
+      fprintf(stderr, "Bad input log line in %s: %s", playname, line); exit(1);
+    }
+    replay_at= cycle; replay_ch= ch;
+    return;
+  }
+  replay_at= LLONG_MAX;
+}
+
+// The next character is due: put it in the keyboard ring
+void replay_input(void)
+{
+  kbinject(replay_ch);
+  replay_next();
+}
+
+// Log the input to the named file
+void init_record(char *name)
+{
+  if ((recfile= fopen(name, "w"))==NULL) {
+    fprintf(stderr, "Unable to open %s\n", name); exit(1);
+  }
+  fprintf(recfile, "# Salmi input log: cycle character\n");
+  recording= 1;
+}
+
+// Take the input from the named log file
+void init_replay(char *name)
+{
+  if ((playfile= fopen(name, "r"))==NULL) {
+    fprintf(stderr, "Unable to open %s\n", name); exit(1);
+  }
+  playname= name;
+  replay_at= 0;
+  replay_next();
+  replaying= 1;
+}
@@ -0,0 +1,295 @@
+// Emulate the DS12C887 real-time clock.
+// (c) 2023 Warren Toomey, GPL3
+//
+// The board has a DS12C887 on the bus, but the address decoding for
+// it isn't done yet. Here it is at $FEC0 and $FEC1: the 6809 writes
+// a register number to $FEC0, then reads or writes the register at
+// $FEC1. This is the DS12C887's address strobe then data access.
+//
+// The registers are those of the chip: the time and date at 0-9 and
+// $32 in BCD or binary, 12 or 24 hour format, the alarm at 1, 3 and 5,
+// registers A to D at $0A-$0D and the rest is NVRAM. The oscillator
+// always runs, whatever the DV bits in register A say, and daylight
+// saving isn't done.
+//
+// The clock runs on emulated cycles. It starts at the host's local
+// time, and each second is RTC_HZ cycles or, with -c, the paced clock
+// rate so that it keeps to wall time. Register C's periodic, alarm
+// and update-ended flags are set as the cycles pass and, if enabled
+// in register B, hold the IRQ line down until register C is read.
+// check_irq() calls rtc_event() at rtc_due, the next cycle where an
+// enabled interrupt happens. When the CPU is idle, cpu_idle() skips
+// forward to it. Flags for interrupts which are not enabled are
+// worked out when register C is read.
+
+#include "6809.h"
+#include <math.h>
+#include <time.h>
+
+#define RTC_HZ	 2000000.0		// Cycles a second without -c
+
+#define REG_A	 0x0a
+#define REG_B	 0x0b
+#define REG_C	 0x0c
+#define REG_D	 0x0d
+#define REG_CENT 0x32			// Century
+
+#define A_UIP	 0x80			// Register A: update in progress
+#define B_SET	 0x80			// Register B: stop updates to set,
+#define B_PIE	 0x40			// periodic interrupt enable,
+#define B_AIE	 0x20			// alarm interrupt enable,
+#define B_UIE	 0x10			// update-ended interrupt enable,
+#define B_DM	 0x04			// binary not BCD,
+#define B_24	 0x02			// 24 hour clock
+#define C_IRQF	 0x80			// Register C: interrupt request,
+#define C_PF	 0x40			// periodic,
+#define C_AF	 0x20			// alarm,
+#define C_UF	 0x10			// update ended
+#define D_VRT	 0x80			// Register D: valid RAM and time
+
+extern long long total;
+extern int cpu_period;
+long long rtc_due= LLONG_MAX;		// Cycle of the next interrupt
+int rtc_irq= 0;				// Is the RTC's IRQ line down?
+static UINT8 rtcreg[128];		// The registers and NVRAM
+static UINT8 rtcindex;			// Register selected at $FEC0
+static double rtc_rate;			// Cycles a second
+static double rtc_epoch= -1;		// Time at cycle 0, in seconds
+static double rtc_lastc;		// Time when register C was last read
+
+static long long cycles_now(void)
+{
+  return(total + cpu_period - cpu_clk);
+}
+
+// The time now, in seconds since 1970 in local time
+static double rtc_time(void)
+{
+  return(rtc_epoch + cycles_now() / rtc_rate);
+}
+
+// The periodic interrupt rate from register A, or 0 if off
+static double rtc_period(void)
+{
+  int rs= rtcreg[REG_A] & 0x0f;
+
+  if (rs == 0) return(0);
+  if (rs < 3) rs += 7;
+  return(ldexp(1.0, rs - 1) / 32768.0);
+}
+
+// Convert a value to and from the register format
+static UINT8 to_reg(int val)
+{
+  return((rtcreg[REG_B] & B_DM) ? val : ((val / 10) << 4) | (val % 10));
+}
+
+static int from_reg(UINT8 val)
+{
+  return((rtcreg[REG_B] & B_DM) ? val : (val >> 4) * 10 + (val & 0x0f));
+}
+
+static UINT8 hour_to_reg(int hour)
+{
+  int pm= (hour >= 12) ? 0x80 : 0;
+
+  if (rtcreg[REG_B] & B_24) return(to_reg(hour));
+  hour %= 12;
+  return(to_reg(hour ? hour : 12) | pm);
+}
+
+static int hour_from_reg(UINT8 val)
+{
+  int hour;
+
+  if (rtcreg[REG_B] & B_24) return(from_reg(val));
+  hour= from_reg(val & 0x7f) % 12;
+  return((val & 0x80) ? hour + 12 : hour);
+}
+
+// Put the time now into the time and date registers
+static void rtc_to_regs(void)
+{
+  time_t t= (time_t)floor(rtc_time());
+  struct tm tm;
+
+  gmtime_r(&t, &tm);
+  rtcreg[0]= to_reg(tm.tm_sec);
+  rtcreg[2]= to_reg(tm.tm_min);
+  rtcreg[4]= hour_to_reg(tm.tm_hour);
+  rtcreg[6]= to_reg(tm.tm_wday + 1);
+  rtcreg[7]= to_reg(tm.tm_mday);
+  rtcreg[8]= to_reg(tm.tm_mon + 1);
+  rtcreg[9]= to_reg(tm.tm_year % 100);
+  rtcreg[REG_CENT]= to_reg((tm.tm_year + 1900) / 100);
+}
+
+// Set the time from the time and date registers
+static void rtc_from_regs(void)
+{
+  struct tm tm;
+  double now= rtc_time();
+
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_sec= from_reg(rtcreg[0]);
+  tm.tm_min= from_reg(rtcreg[2]);
+  tm.tm_hour= hour_from_reg(rtcreg[4]);
+  tm.tm_mday= from_reg(rtcreg[7]);
+  tm.tm_mon= from_reg(rtcreg[8]) - 1;
+  tm.tm_year= from_reg(rtcreg[REG_CENT]) * 100 + from_reg(rtcreg[9]) - 1900;
+
+  // Keep the fraction of a second, so the ticks don't move
+  rtc_epoch += (double)timegm(&tm) - floor(now);
+}
+
+// Is the alarm time now? A value with the top two bits set matches any
+static int alarm_now(void)
+{
+  UINT8 now[3]= { rtcreg[0], rtcreg[2], rtcreg[4] };
+  UINT8 alarm[3]= { rtcreg[1], rtcreg[3], rtcreg[5] };
+
+  for (int i=0; i < 3; i++)
+    if ((alarm[i] & 0xc0) != 0xc0 && alarm[i] != now[i]) return(0);
+  return(1);
+}
+
+// Work out when the next enabled interrupt is due
+static void rtc_schedule(void)
+{
+  double now= rtc_time(), period= rtc_period(), next= INFINITY;
+
+  if ((rtcreg[REG_B] & B_PIE) && period)
+    next= (floor(now / period) + 1) * period;
+  if ((rtcreg[REG_B] & (B_AIE|B_UIE)) && !(rtcreg[REG_B] & B_SET))
+    next= fmin(next, floor(now) + 1);
+  rtc_due= isinf(next) ? LLONG_MAX : (long long)ceil((next - rtc_epoch) * rtc_rate);
+  set_rtc_clk();
+}
+
+// Set the register C flags for anything which has
+// happened between then and now, and the IRQ line
+static void rtc_flags(double then, double now)
+{
+  double period= rtc_period();
+  UINT8 b= rtcreg[REG_B];
+
+  if (period && floor(now / period) > floor(then / period))
+    rtcreg[REG_C] |= C_PF;
+  if (!(b & B_SET) && floor(now) > floor(then)) {
+    rtcreg[REG_C] |= C_UF;
+    rtc_to_regs();
+    if ((b & B_AIE) && alarm_now()) rtcreg[REG_C] |= C_AF;
+  }
+  if ((rtcreg[REG_C] & C_PF && b & B_PIE) || (rtcreg[REG_C] & C_AF && b & B_AIE)
+			|| (rtcreg[REG_C] & C_UF && b & B_UIE)) {
+    rtcreg[REG_C] |= C_IRQF;
+    rtc_irq= 1;
+  }
+}
+
+// An enabled interrupt is due
+void rtc_event(void)
+{
+  double now= rtc_time();
+
+  rtc_flags(rtc_lastc, now);
+  rtc_lastc= now;
+  rtc_schedule();
+}
+
+// Read the selected register
+UINT8 read_rtc(void)
+{
+  double now= rtc_time();
+  UINT8 val;
+
+  switch (rtcindex) {
+    case REG_A:
+      val= rtcreg[REG_A] & ~A_UIP;
+      if (!(rtcreg[REG_B] & B_SET) && now - floor(now) > 1 - 244e-6)
+	val |= A_UIP;
+      return(val);
+    case REG_C:
+      // Reading register C clears it and lets the IRQ line go
+      rtc_flags(rtc_lastc, now);
+      rtc_lastc= now;
+      val= rtcreg[REG_C];
+      rtcreg[REG_C]= 0; rtc_irq= 0;
+      return(val);
+    case REG_D:
+      return(D_VRT);
+    case 0: case 2: case 4: case 6: case 7: case 8: case 9: case REG_CENT:
+      if (!(rtcreg[REG_B] & B_SET)) rtc_to_regs();
+      return(rtcreg[rtcindex]);
+  }
+  return(rtcreg[rtcindex]);
+}
+
+// Write to the RTC: select a register at $FEC0, write it at $FEC1
+void recv_rtc(unsigned addr, UINT8 data)
+{
+  UINT8 oldb= rtcreg[REG_B];
+
+  if ((addr & 1) == 0) {
+    rtcindex= data & 0x7f; return;
+  }
+
+  switch (rtcindex) {
+    case REG_B:
+      // Changing the format: get the time in the new one
+      if (!(oldb & B_SET)) rtc_to_regs();
+      rtcreg[REG_B]= data;
+      if ((oldb ^ data) & (B_DM|B_24)) {
+	rtcreg[REG_B]= oldb; rtc_from_regs(); rtcreg[REG_B]= data; rtc_to_regs();
+      }
+      if ((oldb & B_SET) && !(data & B_SET)) rtc_from_regs();
+      break;
+    case REG_C:
+    case REG_D:
+      return;				// Read only
+    case 0: case 2: case 4: case 6: case 7: case 8: case 9: case REG_CENT:
+      if (!(oldb & B_SET)) rtc_to_regs();
+      rtcreg[rtcindex]= data;
+      if (!(oldb & B_SET)) rtc_from_regs();
+      break;
+    default:
+      rtcreg[rtcindex]= data;
+  }
+  rtc_schedule();
+}
+
+// Start the clock at the host's local time, unless a snapshot set it
+void init_rtc(void)
+{
+  time_t now= time(NULL);
+  struct tm tm;
+
+  rtc_rate= pace_hz ? pace_hz : RTC_HZ;
+  if (rtc_epoch < 0) {
+    localtime_r(&now, &tm);
+    rtc_epoch= (double)now + tm.tm_gmtoff;
+    rtcreg[REG_A]= 0x20;		// Oscillator on, no periodic interrupt
+    rtcreg[REG_B]= B_24;
+  }
+  rtc_lastc= rtc_time();
+  rtc_schedule();
+}
+
+// Save the RTC in a snapshot
+void save_rtc(struct snapshot *s)
+{
+  memcpy(s->rtc_reg, rtcreg, sizeof(rtcreg));
+  s->rtc_index= rtcindex;
+  s->rtc_time= rtc_time();
+  s->rtc_irq= rtc_irq;
+}
+
+// Restore the RTC from a snapshot. The cycle count starts
+// again at zero, so the time then is the snapshot's time.
+void load_rtc(struct snapshot *s)
+{
+  memcpy(rtcreg, s->rtc_reg, sizeof(rtcreg));
+  rtcindex= s->rtc_index;
+  rtc_epoch= s->rtc_time;
+  rtc_irq= s->rtc_irq;
+}
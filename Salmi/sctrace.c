@@ -0,0 +1,220 @@
+// Trace the XV6 system calls.
+// (c) 2023 Warren Toomey, GPL3
+//
+// A user program does a system call with SWI2. D holds the first
+// argument, the rest are on the stack above the return address and
+// X holds the call's offset in syscalltable in XV6FS/romfuncs.s.
+// The kernel returns with an RTI from the SWI2's stack frame, with
+// the result in D and errno in X.
+//
+// With -T, swi2() calls sc_call() and rti() calls sc_return(). Each
+// process, i.e. each frame at page 0, can have one call in progress,
+// as it is blocked until the call returns. A call is matched to its
+// return by the S of the SWI2's stack frame, so IRQs and FIRQs from
+// user mode don't get in the way. We write a line to the -T file as
+// each call returns. exit() and exec() don't return, so their line
+// is written with a result of ? when the process' frame does its
+// next system call, or at exit.
+//
+// At exit we add a table of the number of calls to each system call,
+// the errors, and the cycles from the SWI2 to the RTI with a log2
+// histogram. read() and write() are counted separately for each fd,
+// so that console I/O can be told apart from file I/O.
+
+#include "6809.h"
+
+#define NSYSCALL (sizeof(scinfo) / sizeof(scinfo[0]))
+#define SC_FDS	 17			// Columns for read/write: fds 0-15, others
+#define SC_HIST	 24			// Histogram buckets: 2^0 .. 2^23+ cycles
+
+extern long long total;
+extern int cpu_period;
+int sc_trace= 0;			// Are we tracing system calls?
+static FILE *scout;			// Where the trace goes
+
+// The calls in syscalltable order. The argument types are one letter
+// for D and then for each stack argument: d is an int, x a pointer or
+// other word, s a string and l a long.
+static struct {
+  char *name, *args;
+} scinfo[]= {
+  { "exit", "d" }, { "getputc", "" }, { "putc", "d" }, { "exec", "dx" },
+  { "chdir", "s" }, { "close", "d" }, { "dup", "d" }, { "fstat", "dx" },
+  { "link", "ss" }, { "lseek", "dld" }, { "mkdir", "s" }, { "open", "sd" },
+  { "read", "dxd" }, { "unlink", "s" }, { "write", "dxd" },
+  { "tcattr", "dx" }, { "fork", "" }, { "wait", "x" }, { "getpid", "" },
+  { "kill", "d" }, { "pipe", "x" }
+};
+
+// The call in progress for each process
+static struct {
+  int active;
+  int num;				// Index into scinfo[], or -1
+  unsigned sp;				// S after the SWI2
+  int fd;				// fd for read/write, else 0
+  long long start;			// Cycle count at the SWI2
+  char text[200];			// The call and its arguments
+} pending[NUMFRAMES];
+
+// The totals for each call, and for each fd for read/write
+struct scstat {
+  long calls, errors;
+  long long cycles, max;
+  long hist[SC_HIST];
+};
+static struct scstat scstat[NSYSCALL + 1][SC_FDS];
+
+static long long now(void)
+{
+  return(total + cpu_period - cpu_clk);
+}
+
+// Read a word from the user's stack
+static unsigned stackword(unsigned addr)
+{
+  return((memory(addr & 0xffff) << 8) | memory((addr + 1) & 0xffff));
+}
+
+// Add an argument to the text
+static char *add_arg(char *p, char type, unsigned val, unsigned sp)
+{
+  int i;
+
+  switch (type) {
+    case 'd':
+      return(p + sprintf(p, "%d", (short)val));
+    case 'l':
+      return(p + sprintf(p, "%ld", (long)(int)((val << 16) | stackword(sp))));
+    case 's':
+      *p++ = '"';
+      for (i=0; i < 40; i++) {
+	UINT8 ch= memory((val + i) & 0xffff);
+	if (ch == 0) break;
+	*p++ = (ch >= ' ' && ch < 0x7f) ? ch : '.';
+      }
+      if (i == 40) { strcpy(p, "..."); p += 3; }
+      *p++ = '"';
+      *p= '\0';
+      return(p);
+    default:
+      return(p + sprintf(p, "0x%04X", val));
+  }
+}
+
+// Add a finished call to the totals
+static void add_stat(int num, int fd, int result, long long cycles)
+{
+  struct scstat *s= &scstat[num < 0 ? NSYSCALL : num][fd];
+  int b=0;
+
+  s->calls++;
+  if (result == -1) s->errors++;
+  s->cycles += cycles;
+  if (cycles > s->max) s->max= cycles;
+  while (b < SC_HIST-1 && (cycles >> (b+1)) != 0) b++;
+  s->hist[b]++;
+}
+
+// Log a call which didn't return
+static void sc_lost(int proc)
+{
+  fprintf(scout, "[%2d] %s = ?\n", proc, pending[proc].text);
+  pending[proc].active= 0;
+}
+
+// A user process has done an SWI2. sp is the S before it,
+// which has the return address and then the stack arguments.
+void sc_call(unsigned sp)
+{
+  int proc= page0_frame();
+  int num= get_x() / 2;
+  char *args, *p;
+  unsigned argsp= sp + 2;
+
+  if (pending[proc].active) sc_lost(proc);
+  if (get_x() & 1 || num >= NSYSCALL) num= -1;
+
+  p= pending[proc].text;
+  if (num < 0) {
+    p += sprintf(p, "syscall_0x%02X(0x%04X", get_x(), get_d());
+  } else {
+    p += sprintf(p, "%s(", scinfo[num].name);
+    args= scinfo[num].args;
+    for (int i=0; args[i]; i++) {
+      if (i > 0) p += sprintf(p, ", ");
+      if (i == 0)
+	p= add_arg(p, args[i], get_d(), 0);
+      else {
+	p= add_arg(p, args[i], stackword(argsp), argsp + 2);
+	argsp += (args[i] == 'l') ? 4 : 2;
+      }
+    }
+  }
+  strcpy(p, ")");
+
+  pending[proc].fd= 0;
+  if (num >= 0 && (!strcmp(scinfo[num].name, "read") ||
+		   !strcmp(scinfo[num].name, "write")))
+    pending[proc].fd= (get_d() < SC_FDS-1) ? get_d() : SC_FDS-1;
+  pending[proc].active= 1;
+  pending[proc].num= num;
+  pending[proc].sp= (sp - 12) & 0xffff;
+  pending[proc].start= now();
+}
+
+// There has been an RTI from the stack frame at sp. If it is
+// back to a user process and from its SWI2, the call is done.
+void sc_return(unsigned sp)
+{
+  int proc= page0_frame();
+  long long cycles;
+
+  if (kernel_mode() || !pending[proc].active || pending[proc].sp != sp)
+    return;
+  cycles= now() - pending[proc].start;
+  fprintf(scout, "[%2d] %s = %d", proc, pending[proc].text, (short)get_d());
+  if ((short)get_d() == -1) fprintf(scout, " errno %d", get_x());
+  fprintf(scout, " <%lld cycles>\n", cycles);
+  add_stat(pending[proc].num, pending[proc].fd, (short)get_d(), cycles);
+  pending[proc].active= 0;
+}
+
+// Finish off the trace with the totals
+static void sc_report(void)
+{
+  struct scstat *s;
+  char name[40];
+
+  for (int i=0; i < NUMFRAMES; i++)
+    if (pending[i].active) sc_lost(i);
+
+  fprintf(scout, "\n%-14s %8s %6s %14s %10s %10s  log2(cycles): calls\n",
+	"syscall", "calls", "errors", "cycles", "average", "max");
+  for (int i=0; i <= NSYSCALL; i++)
+    for (int fd=0; fd < SC_FDS; fd++) {
+      s= &scstat[i][fd];
+      if (s->calls == 0) continue;
+      if (i == NSYSCALL) strcpy(name, "unknown");
+      else if (fd == SC_FDS-1) sprintf(name, "%s fd>=%d", scinfo[i].name, fd);
+      else if (!strcmp(scinfo[i].name, "read") || !strcmp(scinfo[i].name, "write"))
+	sprintf(name, "%s fd %d", scinfo[i].name, fd);
+      else strcpy(name, scinfo[i].name);
+      fprintf(scout, "%-14s %8ld %6ld %14lld %10lld %10lld ", name, s->calls,
+	s->errors, s->cycles, s->cycles / s->calls, s->max);
+      for (int b=0; b < SC_HIST; b++)
+	if (s->hist[b]) fprintf(scout, " %d:%ld", b, s->hist[b]);
+      fprintf(scout, "\n");
+    }
+  fclose(scout);
+}
+
+// Start tracing system calls to the named file
+void init_sctrace(char *name)
+{
+  if ((scout= fopen(name, "w"))==NULL) {
+    fprintf(stderr, "Unable to open %s\n", name); exit(1);
+  }
+  setvbuf(scout, NULL, _IOLBF, 0);	// So that the trace can be tailed
+  sc_trace= 1;
+  atexit(sc_report);
+}
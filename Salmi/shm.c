@@ -0,0 +1,78 @@
+// Export the 6809's memory in POSIX shared memory.
+// (c) 2023 Warren Toomey, GPL3
+//
+// With -E, the 64 RAM frames and the ROM are moved into one POSIX
+// shared memory segment, so that other programs can watch the 6809's
+// memory and page table while it runs. The simulator uses the memory
+// in the segment directly, so the only cost is a few stores each time
+// remap() changes the mapping. The segment is laid out as:
+//
+//	struct shmhead	at offset 0, see 6809.h
+//	frames		NUMFRAMES * PAGESIZE bytes at frames_off
+//	ROM		ROMSIZE bytes at rom_off
+//
+// The header gives the sizes and offsets, so that a tool can check
+// them. seq is odd while remap() is changing the page table entries
+// and the mapping flags in the header: to get a consistent copy, read
+// seq, the entries and seq again, and retry if seq was odd or changed.
+// The segment is removed when the simulator exits.
+
+#include "6809.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#define SHM_FRAMES 4096			// Offset of the frames, a page boundary
+
+struct shmhead *shmhead= NULL;		// The exported segment, if any
+static char *shmname;
+
+// Remove the segment at exit
+static void remove_shm(void)
+{
+  shm_unlink(shmname);
+}
+
+// Move the memory into the named shared memory segment
+void init_shm(char *name)
+{
+  size_t size= SHM_FRAMES + RAMSIZE + ROMSIZE;
+  UINT8 *seg;
+  int fd;
+
+  // Segment names must start with a slash
+  shmname= name;
+  if (*name != '/') {
+    shmname= malloc(strlen(name) + 2);
+    if (shmname == NULL) {
+      fprintf(stderr, "malloc fail in init_shm()\n"); exit(1);
+    }
+    sprintf(shmname, "/%s", name);
+  }
+
+  if ((fd= shm_open(shmname, O_RDWR|O_CREAT|O_EXCL, 0644)) == -1 ||
+      ftruncate(fd, size) == -1) {
+    fprintf(stderr, "Unable to create shared memory %s\n", shmname); exit(1);
+  }
+  seg= mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (seg == MAP_FAILED) {
+    fprintf(stderr, "Unable to mmap shared memory %s\n", shmname); exit(1);
+  }
+  close(fd);
+  atexit(remove_shm);
+
+  shmhead= (struct shmhead *)seg;
+  strcpy(shmhead->magic, SHM_MAGIC);
+  shmhead->size= size;
+  shmhead->pid= getpid();
+  shmhead->pagesize= PAGESIZE;
+  shmhead->numframes= NUMFRAMES;
+  shmhead->numpages= NUMPAGES;
+  shmhead->romsize= ROMSIZE;
+  shmhead->frames_off= SHM_FRAMES;
+  shmhead->rom_off= SHM_FRAMES + RAMSIZE;
+
+  // Move the memory. remap() then fills in the mapping
+  export_memory(&seg[SHM_FRAMES], &seg[SHM_FRAMES + RAMSIZE]);
+}
@@ -0,0 +1,74 @@
+// Save and restore snapshots of the whole machine.
+// (c) 2023 Warren Toomey, GPL3
+//
+// A snapshot file is just a struct snapshot. It is written with
+// one fwrite(). To restore it, we mmap() the file privately and
+// let each part of the simulator pull its state out of it. The
+// page frames are used in place, so pages of the file are only
+// read when the 6809 touches them and are copied on write. This
+// lets a test start from a machine which has already booted.
+
+#include "6809.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+char *snapfile= NULL;		// With -S, save a snapshot here when idle
+
+// Write a snapshot of the machine to the named file
+void save_snapshot(char *name)
+{
+  struct snapshot *s;
+  FILE *out;
+
+  s= (struct snapshot *)calloc(1, sizeof(struct snapshot));
+  if (s==NULL) {
+    fprintf(stderr, "calloc fail in save_snapshot()\n"); exit(1);
+  }
+  strcpy(s->magic, SNAP_MAGIC);
+  s->size= sizeof(struct snapshot);
+  save_cpu(s);
+  save_memory(s);
+  save_ch375(s);
+  save_uart(s);
+  save_rtc(s);
+
+  if ((out= fopen(name, "w"))==NULL) {
+    fprintf(stderr, "Unable to open snapshot %s\n", name); exit(1);
+  }
+  if (fwrite(s, sizeof(struct snapshot), 1, out) != 1 || fclose(out) != 0) {
+    fprintf(stderr, "Unable to write snapshot %s\n", name); exit(1);
+  }
+  free(s);
+}
+
+// Restore the machine from the named snapshot file.
+// The mapping is kept for the rest of the run.
+void load_snapshot(char *name)
+{
+  struct snapshot *s;
+  struct stat st;
+  int fd;
+
+  if ((fd= open(name, O_RDONLY))==-1 || fstat(fd, &st)==-1) {
+    fprintf(stderr, "Unable to open snapshot %s\n", name); exit(1);
+  }
+  if (st.st_size != sizeof(struct snapshot)) {
+    fprintf(stderr, "%s is not a snapshot for this simulator\n", name); exit(1);
+  }
+  s= (struct snapshot *)mmap(NULL, sizeof(struct snapshot),
+		PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (s==MAP_FAILED) {
+    fprintf(stderr, "Unable to mmap snapshot %s\n", name); exit(1);
+  }
+  close(fd);
+  if (strcmp(s->magic, SNAP_MAGIC) || s->size != sizeof(struct snapshot)) {
+    fprintf(stderr, "%s is not a snapshot for this simulator\n", name); exit(1);
+  }
+
+  load_cpu(s);
+  load_memory(s);
+  load_ch375(s);
+  load_uart(s);
+  load_rtc(s);
+}
@@ -1,24 +1,85 @@
 // Code to deal with the UART
 // (c) 2023 Warren Toomey, GPL3
+//
+// The UART has two channels. Channel A is read at $FE10 and written
+// at $FE20, channel B at $FE11 and $FE21. Bit 0 of $FE12 is set when
+// channel A has input to read and bit 1 when channel B does, so that
+// the IRQ handler can tell them apart. A channel's input only raises
+// the IRQ when its bit is set in the mask written to $FE12. This is
+// just channel A at reset, as the ROM's IRQ handler only reads $FE10;
+// otherwise input on B would hand it a NUL each time. Each channel's
+// input and output goes to a backend given with -A or -B:
+//
+//	tty		the terminal, i.e. stdin and stdout
+//	pty		a new pseudo-terminal, whose name is printed
+//	unix:path	a Unix socket: wait for one connection on it
+//	file:path	output to a file, with no input
+//	none		no input, and the output is thrown away
+//
+// Channel A is on the tty and channel B is on none by default.
+// Only one channel can be on the tty.
 
+#define _GNU_SOURCE			// For posix_openpt() and friends
 #include "6809.h"
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 
 // Original blocking terminal setting
 struct termios orig_termios;
 
-// We use a character buffer to get as much input from
-// the keyboard (so we don't lose any), and then we can
-// replay it to the simulated code
-#define CBUFSIZE 4096
-unsigned char termbuf[CBUFSIZE];
-int charsleft=0;
-int termbufindex=0;
+// Output to the UART is kept in a buffer and written out in one go.
+// When the output is a terminal, the buffer is flushed at the end of
+// each line. Otherwise it is only flushed when it is full or at the
+// end of each cpu_execute() period. It is always flushed before the
+// 6809 reads input, when it goes idle and before the monitor runs,
+// so that prompts are seen.
+#define OBUFSIZE 16384
+
+// Keyboard input is read by a separate thread which places the
+// characters into a single-producer, single-consumer ring buffer
+// for each channel. The CPU loop only has to look at the input_ready
+// flag, so we don't do a read() syscall after every emulated
+// instruction. The head is only changed by the input thread and the
+// tail only by the CPU thread, so the rings need no lock.
+struct uartchan {
+  char *spec;				// The backend, from -A or -B
+  int infd;				// Where the input comes from, or -1
+  int outfd;				// Where the output goes, or -1
+  int outtty;				// Is it a terminal? -1 if not known
+  int outcount;				// Number of characters in outbuf
+  unsigned char outbuf[OBUFSIZE];
+  unsigned char termbuf[CBUFSIZE];
+  atomic_uint termhead;			// Next position to write to
+  atomic_uint termtail;			// Next position to read from
+  atomic_int ready;			// Set when the ring has characters
+};
+
+static struct uartchan chan[NUMUARTS];
+static char *outname= NULL;		// -o file for channel A's output
+static int use_tty= 0;			// Is a channel on the terminal?
+atomic_int input_ready= 0;		// Set when an enabled ring has characters
+static atomic_uint irqmask= 1;		// Channels whose input raises the IRQ
+
+// The input thread is parked while the monitor is using
+// the terminal. The wake pipe gets it out of its poll().
+static pthread_t input_tid;
+static pthread_mutex_t input_mutex= PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t input_cond= PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ready_cond= PTHREAD_COND_INITIALIZER;
+static int input_running=0;		// Is the thread alive?
+static int input_paused=0;		// Has the thread been asked to stop?
+static int input_parked=0;		// Has the thread stopped?
+static int wakepipe[2];
 
 void reset_terminal_mode()
 {
-    tcsetattr(0, TCSANOW, &orig_termios);
+    if (use_tty) tcsetattr(0, TCSANOW, &orig_termios);
 }
 
 void save_old_terminal_mode()
@@ -30,6 +91,9 @@ int ttySetCbreak(void)
 {
     struct termios t;
 
+    if (!use_tty)
+        return 0;
+
     if (tcgetattr(0, &t) == -1)
         return -1;
 
@@ -47,41 +111,402 @@ int ttySetCbreak(void)
     return 0;
 }
 
+// Open a new pseudo-terminal for a channel. We keep the slave
+// side open as well, so that the master doesn't see a hangup
+// when nobody else has it open.
+static void open_pty(struct uartchan *c, int n)
+{
+  struct termios t;
+  char *name;
+  int fd, slave;
+
+  if ((fd= posix_openpt(O_RDWR|O_NOCTTY)) == -1 || grantpt(fd) == -1 ||
+      unlockpt(fd) == -1 || (name= ptsname(fd)) == NULL ||
+      (slave= open(name, O_RDWR|O_NOCTTY)) == -1) {
+    fprintf(stderr, "Unable to open a pty for UART %c\n", 'A' + n); exit(1);
+  }
+  tcgetattr(slave, &t);
+  cfmakeraw(&t);
+  tcsetattr(slave, TCSANOW, &t);
+  fprintf(stderr, "UART %c is on %s\n", 'A' + n, name);
+  c->infd= c->outfd= fd;
+}
+
+// Listen on a Unix socket and wait for one connection
+static void open_socket(struct uartchan *c, int n, char *path)
+{
+  struct sockaddr_un addr;
+  int fd, conn;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family= AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket name too long: %s\n", path); exit(1);
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if ((fd= socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+      bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, 1) == -1) {
+    fprintf(stderr, "Unable to listen on %s\n", path); exit(1);
+  }
+  fprintf(stderr, "UART %c waiting for a connection on %s\n", 'A' + n, path);
+  while ((conn= accept(fd, NULL, NULL)) == -1)
+    if (errno != EINTR) {
+      fprintf(stderr, "Unable to accept on %s\n", path); exit(1);
+    }
+  close(fd);
+  c->infd= c->outfd= conn;
+}
+
+// Set the backend for a UART channel
+void set_uart(int n, char *spec)
+{
+  chan[n].spec= spec;
+}
+
+// Send the UART output to the named file instead of stdout
+void set_output(char *name)
+{
+  outname= name;
+}
+
+// Open the UART backends
+void init_uart(void)
+{
+  struct uartchan *c;
+
+  if (chan[0].spec == NULL) chan[0].spec= "tty";
+  if (chan[1].spec == NULL) chan[1].spec= "none";
+
+  for (int n=0; n < NUMUARTS; n++) {
+    c= &chan[n];
+    c->infd= c->outfd= c->outtty= -1;
+    if (!strcmp(c->spec, "tty")) {
+      if (use_tty) {
+	fprintf(stderr, "Only one UART can be on the tty\n"); exit(1);
+      }
+      c->infd= 0; c->outfd= 1; use_tty= 1;
+    } else if (!strcmp(c->spec, "pty"))
+      open_pty(c, n);
+    else if (!strncmp(c->spec, "unix:", 5))
+      open_socket(c, n, c->spec + 5);
+    else if (!strncmp(c->spec, "file:", 5)) {
+      if ((c->outfd= open(c->spec + 5, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1) {
+	fprintf(stderr, "Unable to open %s\n", c->spec + 5); exit(1);
+      }
+    } else if (strcmp(c->spec, "none")) {
+      fprintf(stderr, "Unknown UART backend %s\n", c->spec); exit(1);
+    }
+  }
+
+  if (outname != NULL &&
+      (chan[0].outfd= open(outname, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1) {
+    fprintf(stderr, "Unable to open %s\n", outname); exit(1);
+  }
+
+  // Don't die if a socket or pty is closed under us
+  signal(SIGPIPE, SIG_IGN);
+}
+
+// Wait until the monitor is finished with the terminal
+static void input_wait_unpaused(void)
+{
+  pthread_mutex_lock(&input_mutex);
+  while (input_paused) {
+    input_parked=1;
+    pthread_cond_broadcast(&input_cond);
+    pthread_cond_wait(&input_cond, &input_mutex);
+  }
+  input_parked=0;
+  pthread_mutex_unlock(&input_mutex);
+}
+
+// Read what we have room for from a channel into its ring.
+// Return 0 at EOF, otherwise 1.
+static int input_read(struct uartchan *c)
+{
+  unsigned head, tail, space;
+  int r;
+
+  // Work out how much contiguous room is left in the ring.
+  // If it is full, give the 6809 some time to drain it.
+  head= atomic_load(&c->termhead);
+  tail= atomic_load(&c->termtail);
+  space= CBUFSIZE - (head - tail);
+  if (space == 0) { usleep(1000); return(1); }
+  if (space > CBUFSIZE - (head % CBUFSIZE))
+    space= CBUFSIZE - (head % CBUFSIZE);
+
+  r= read(c->infd, &c->termbuf[head % CBUFSIZE], space);
+
+  // A zero read on a terminal in cbreak mode is not an EOF.
+  // Otherwise stop at EOF or on an error.
+  if (r < 1) {
+    if (r == 0 && isatty(c->infd)) return(1);
+    if (r == -1 && errno == EINTR) return(1);
+    return(0);
+  }
+
+  atomic_store(&c->termhead, head + r);
+  atomic_store(&c->ready, 1);
+  if (atomic_load(&irqmask) & (1 << (c - chan)))
+    atomic_store(&input_ready, 1);
+
+  // Wake up the CPU thread if it is idle
+  pthread_mutex_lock(&input_mutex);
+  pthread_cond_broadcast(&ready_cond);
+  pthread_mutex_unlock(&input_mutex);
+  return(1);
+}
+
+// The input thread. Block until there is input on
+// any channel and copy it into the channel's ring.
+static void *input_thread(void *arg)
+{
+  struct pollfd fds[NUMUARTS+1];
+  int live=0, r;
+  char junk[16];
+
+  (void)arg;
+  for (int n=0; n < NUMUARTS; n++) {
+    fds[n].fd= chan[n].infd; fds[n].events= POLLIN;
+    if (chan[n].infd != -1) live++;
+  }
+  fds[NUMUARTS].fd= wakepipe[0]; fds[NUMUARTS].events= POLLIN;
+
+  // Stop when all the channels have got to EOF
+  while (live) {
+    input_wait_unpaused();
+
+    if (poll(fds, NUMUARTS+1, -1) == -1) continue;
+
+    // Woken up by the CPU thread, go and check if we are paused
+    if (fds[NUMUARTS].revents) {
+      r= read(wakepipe[0], junk, sizeof(junk)); (void)r; continue;
+    }
+
+    // A negative fd is ignored by poll()
+    for (int n=0; n < NUMUARTS; n++)
+      if (fds[n].revents && input_read(&chan[n]) == 0) {
+	fds[n].fd= -1; live--;
+      }
+  }
+
+  pthread_mutex_lock(&input_mutex);
+  input_running=0;
+  pthread_cond_broadcast(&input_cond);
+  pthread_cond_broadcast(&ready_cond);
+  pthread_mutex_unlock(&input_mutex);
+  return(NULL);
+}
+
+// Start the input thread
+void start_input_thread(void)
+{
+  sigset_t set, oldset;
+
+  if (pipe(wakepipe) == -1) {
+    fprintf(stderr, "Unable to create the input wake pipe\n"); exit(1);
+  }
+
+  // SIGINT must go to the CPU thread, not the input thread
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &set, &oldset);
+  input_running=1;
+  if (pthread_create(&input_tid, NULL, input_thread, NULL) != 0) {
+    fprintf(stderr, "Unable to create the input thread\n"); exit(1);
+  }
+  pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+// Stop the input thread reading from the keyboard
+// so that the monitor can use it.
+void pause_input(void)
+{
+  int err;
+
+  pthread_mutex_lock(&input_mutex);
+  input_paused=1;
+  if (input_running) {
+    err= write(wakepipe[1], "w", 1); (void)err;
+    while (input_running && !input_parked)
+      pthread_cond_wait(&input_cond, &input_mutex);
+  }
+  pthread_mutex_unlock(&input_mutex);
+}
+
+// Let the input thread read from the keyboard again
+void resume_input(void)
+{
+  pthread_mutex_lock(&input_mutex);
+  input_paused=0;
+  pthread_cond_broadcast(&input_cond);
+  pthread_mutex_unlock(&input_mutex);
+}
+
+// Write out any buffered UART output
+void flush_output(void)
+{
+  struct uartchan *c;
+  int n, done;
+
+  for (c= chan; c < &chan[NUMUARTS]; c++) {
+    for (done= 0; done < c->outcount; ) {
+      n= write(c->outfd, &c->outbuf[done], c->outcount - done);
+      if (n == -1) {
+	if (errno == EINTR) continue;
+	break;
+      }
+      done += n;
+    }
+    c->outcount= 0;
+  }
+}
+
+// Write a character to a UART channel
+void uart_write(int n, unsigned char ch)
+{
+  struct uartchan *c= &chan[n];
+
+  if (n == 0 && itrace_match) itrace_putc(ch);
+  if (c->outfd == -1) return;
+  if (c->outtty == -1) c->outtty= isatty(c->outfd);
+  c->outbuf[c->outcount++]= ch;
+  if (c->outcount == OBUFSIZE || (ch == '\n' && c->outtty)) flush_output();
+}
+
+// Block until there is keyboard input, when the CPU is idle.
+// Wake up every so often to see if a SIGINT wants the monitor.
+// Return 0 if there is no input and there can't be any more.
+int wait_for_input(void)
+{
+  struct timespec ts;
+  int more;
+
+  flush_output();
+  pthread_mutex_lock(&input_mutex);
+  while (!atomic_load(&input_ready) && input_running && !monitor_on) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 100000000;
+    if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+    pthread_cond_timedwait(&ready_cond, &input_mutex, &ts);
+  }
+  more= atomic_load(&input_ready) || input_running;
+  pthread_mutex_unlock(&input_mutex);
+  return(more);
+}
+
 // Return 1 if there is a character ready to read from the
 // keyboard, otherwise return 0.
 int kbhit()
 {
-    int r;
+  return(atomic_load(&input_ready));
+}
+
+// Get the status byte: bit n is set when channel n has input
+unsigned uart_status(void)
+{
+  unsigned status= 0;
 
-    // We have characters buffered
-    if (charsleft >0) return(1);
+  for (int n=0; n < NUMUARTS; n++)
+    if (atomic_load(&chan[n].ready)) status |= 1 << n;
+  return(status);
+}
 
-    // OK, try to get some characters into the buffer
-    // Return empty if there was nothing to read
-    if ((r=read(0, &termbuf, CBUFSIZE)) <1)
-      return(0);
+// Set input_ready if an enabled channel has input. The input
+// thread sets a channel's flag before it looks at the mask.
+static void set_input_ready(void)
+{
+  atomic_store(&input_ready, 0);
+  if (uart_status() & atomic_load(&irqmask))
+    atomic_store(&input_ready, 1);
+}
 
-    // We read one or more characters, so update the charsleft
-    // and return that we have characters to read
-    charsleft= r;
-    termbufindex=0;
-    return(1);
+// Set which channels' input raises the IRQ
+void uart_irqmask(unsigned mask)
+{
+  atomic_store(&irqmask, mask & ((1 << NUMUARTS) - 1));
+  set_input_ready();
 }
 
-// Read a character from the keyboard. This should be
+// Read a character from a UART channel. This should be
 // done in the IRQ handler so that we know something
 // will be read. Returns 0 if no characters available.
-unsigned kbread(void) {
-  // We have no characters; try to get some
-  if (charsleft == 0) kbhit();
-  // Still no characters, return something useless
-  if (charsleft == 0) return(0);
-
-// printf("%d charsleft, index %d, char %c\n", charsleft, termbufindex,
-// 	termbuf[ termbufindex]);
-
-  // At this point we have charsleft > 0
-  // Decrement the number of characters and return one of them
-  charsleft--;
-  return(termbuf[ termbufindex++ ]);
+unsigned uart_read(int n) {
+  struct uartchan *c= &chan[n];
+  unsigned tail;
+  unsigned char ch;
+
+  flush_output();
+
+  // No characters, return something useless
+  tail= atomic_load(&c->termtail);
+  if (tail == atomic_load(&c->termhead)) return(0);
+
+  // Get the character and move the tail up
+  ch= c->termbuf[ tail % CBUFSIZE ];
+  atomic_store(&c->termtail, ++tail);
+  if (recording && n == 0) record_input(ch);
+
+  // Clear the ready flags if the ring is now empty. Check again
+  // afterwards, in case the input thread added some more.
+  if (tail == atomic_load(&c->termhead)) {
+    atomic_store(&c->ready, 0);
+    if (tail != atomic_load(&c->termhead))
+      atomic_store(&c->ready, 1);
+    set_input_ready();
+  }
+  return(ch);
+}
+
+// Add a character to channel A's ring from the CPU thread.
+// This is only done with -K, when there is no input thread.
+void kbinject(unsigned char ch)
+{
+  struct uartchan *c= &chan[0];
+  unsigned head= atomic_load(&c->termhead);
+
+  if (head - atomic_load(&c->termtail) == CBUFSIZE) {
+    fprintf(stderr, "Keyboard ring full, input lost\n"); return;
+  }
+  c->termbuf[ head % CBUFSIZE ]= ch;
+  atomic_store(&c->termhead, head + 1);
+  atomic_store(&c->ready, 1);
+  set_input_ready();
+}
+
+// Save the input which the 6809 hasn't read yet
+void save_uart(struct snapshot *s)
+{
+  struct uartchan *c;
+  unsigned tail, head;
+
+  for (int n=0; n < NUMUARTS; n++) {
+    c= &chan[n];
+    tail= atomic_load(&c->termtail);
+    head= atomic_load(&c->termhead);
+    s->termcount[n]= head - tail;
+    for (unsigned i=0; i < s->termcount[n]; i++)
+      s->termbuf[n][i]= c->termbuf[ (tail + i) % CBUFSIZE ];
+  }
+  s->uart_irqmask= atomic_load(&irqmask);
+}
+
+// Put the unread input back. This is done
+// before the input thread is started.
+void load_uart(struct snapshot *s)
+{
+  struct uartchan *c;
+
+  for (int n=0; n < NUMUARTS; n++) {
+    c= &chan[n];
+    memcpy(c->termbuf, s->termbuf[n], s->termcount[n]);
+    atomic_store(&c->termtail, 0);
+    atomic_store(&c->termhead, s->termcount[n]);
+    atomic_store(&c->ready, s->termcount[n] != 0);
+  }
+  atomic_store(&irqmask, s->uart_irqmask);
+  set_input_ready();
 }
@@ -10,6 +10,8 @@
 // * After changing buffer data, call bwrite to write it to disk.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
+// * To read or write a run of blocks which are contiguous on
+//     the disk in one go, call breadn or bwriten.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
 //
@@ -93,6 +95,28 @@ void bwrite(struct buf *b) {
   blkrw(b);
 }
 
+// Read n blocks which are contiguous on the disk, starting at
+// blockno, straight into dst without going through the cache.
+// bwrite() writes through, so any cached copies are the same
+// as what is on the disk.
+void breadn(xvblk_t blockno, char *dst, Int n) {
+  blkrwn(blockno, dst, n, 0);
+}
+
+// Write n blocks from src to the disk, starting at blockno,
+// without going through the cache. Bring any cached copies
+// up to date with what we wrote.
+void bwriten(xvblk_t blockno, char *src, Int n) {
+  struct buf *b;
+
+  blkrwn(blockno, src, n, 1);
+  for (b = bcache.head.next; b != &bcache.head; b = b->next) {
+    if ((b->flags & B_VALID) && b->blockno >= blockno &&
+	b->blockno < blockno + n)
+      rommemcpy(BSIZE, src + ((b->blockno - blockno) << 9), b->data);
+  }
+}
+
 // Release a locked buffer.
 // Move to the head of the MRU list.
 void brelse(struct buf *b) {
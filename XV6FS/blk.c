@@ -1,4 +1,5 @@
-// Access the CH375 block device
+// Access the CH375 block device, or with PVDISK
+// the paravirtual disk in the Salmi simulator
 
 #include <unistd.h>
 #include <sys/stat.h>
@@ -9,6 +10,58 @@
 #include <xv6/fs.h>
 #include <xv6/buf.h>
 
+#ifdef PVDISK
+// Salmi's paravirtual disk. We give it a block number, the
+// physical frame and offset of the block's memory and a command.
+// It copies the whole block in one go, then sends an FIRQ and
+// the FIRQ handler puts its status into chstatus. We find the
+// frame by reading the PTE for the page, which Salmi lets us do.
+#define pvblock  ((volatile unsigned long *) 0xfe90)
+#define pvframe  ((volatile unsigned char *) 0xfe94)
+#define pvoffset ((volatile unsigned short *) 0xfe95)
+#define pvcmd    ((volatile unsigned char *) 0xfe97)
+#define ptes     ((volatile unsigned char *) 0xfe70)
+#define PV_READ  0x01
+#define PV_WRITE 0x02
+#define PV_OK    0x14
+
+extern volatile unsigned char chstatus;
+
+// A block which runs over the end of a page
+// is bounced through here, in the kernel data
+static unsigned char pvbuf[BSIZE];
+
+// Move count blocks starting at lba between the disk and buf.
+// Return 1 if success, 0 if failure.
+static int pvrw(unsigned char cmd, unsigned char *buf, xvblk_t lba, Int count) {
+  unsigned char *addr;
+  Int bounce;
+
+  for (; count > 0; count--, lba++, buf += BSIZE) {
+    bounce = ((Uint) buf & (PGSIZE - 1)) > PGSIZE - BSIZE;
+    addr = bounce ? pvbuf : buf;
+    if (bounce && cmd == PV_WRITE)
+      rommemcpy(BSIZE, buf, pvbuf);
+
+    chstatus = 0xff;
+    *pvblock = lba;
+    *pvframe = ptes[(Uint) addr >> 13] & (NFRAMES - 1);
+    *pvoffset = (Uint) addr & (PGSIZE - 1);
+    *pvcmd = cmd;
+    while (chstatus == 0xff) ;
+    if (chstatus != PV_OK)
+      return 0;
+
+    if (bounce && cmd == PV_READ)
+      rommemcpy(BSIZE, pvbuf, buf);
+  }
+  return 1;
+}
+
+#define readblocks(buf, lba, count)  pvrw(PV_READ, buf, lba, count)
+#define writeblocks(buf, lba, count) pvrw(PV_WRITE, buf, lba, count)
+#endif
+
 // Read/write a buffer
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
@@ -17,12 +70,24 @@ void blkrw(struct buf *b) {
     panic("bl2");
 
   if (b->flags & B_DIRTY) {
-    if (writeblock(b->data, b->blockno) == 0)
+    if (writeblocks(b->data, b->blockno, 1) == 0)
       panic("bl3");
     b->flags &= ~B_DIRTY;
   } else {
-    if (readblock(b->data, b->blockno) == 0)
+    if (readblocks(b->data, b->blockno, 1) == 0)
       panic("bl4");
   }
   b->flags |= B_VALID;
 }
+
+// Read or write count blocks which are contiguous on the disk,
+// starting at blockno, straight to or from addr
+void blkrwn(xvblk_t blockno, char *addr, Int count, Int write) {
+  if (write) {
+    if (writeblocks((unsigned char *) addr, blockno, count) == 0)
+      panic("bl5");
+  } else {
+    if (readblocks((unsigned char *) addr, blockno, count) == 0)
+      panic("bl6");
+  }
+}
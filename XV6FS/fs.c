@@ -21,6 +21,7 @@
 #include <xv6/proc.h>
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define MAXRUN 32		// Most blocks moved by breadn/bwriten at once
 void itrunc(struct inode *);
 struct superblock sb;
 
@@ -391,12 +392,27 @@ void stati(struct inode *ip, struct xvstat *st) {
   st->size = ip->size;
 }
 
+// The n bytes at off in ip start on a block boundary and cover at
+// least one block. Find how many of those whole blocks are next to
+// each other on the disk, up to MAXRUN. Set *first to the first one.
+static Int bmapn(struct inode *ip, xvoff_t off, xvoff_t n, xvblk_t *first) {
+  Int cnt;
+
+  *first = bmap(ip, off >> 9);
+  for (cnt = 1; cnt < MAXRUN && (xvoff_t) (cnt + 1) * BSIZE <= n; cnt++)
+    if (bmap(ip, (off >> 9) + cnt) != *first + cnt)
+      break;
+  return cnt;
+}
+
 //PAGEBREAK!
 // Read data from inode.
 // Caller must hold ip->lock.
 xvoff_t readi(struct inode *ip, char *dst, xvoff_t off, xvoff_t n) {
   Uint tot, m;
   struct buf *bp;
+  xvblk_t blk;
+  Int cnt;
 
   if (off > ip->size || off + n < off)
     return -1;
@@ -404,6 +420,14 @@ xvoff_t readi(struct inode *ip, char *dst, xvoff_t off, xvoff_t n) {
     n = ip->size - off;
 
   for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+    // Read whole blocks which are together on the disk
+    // straight into dst with one CH375 command
+    if ((off & (BSIZE-1)) == 0 && n - tot >= BSIZE) {
+      cnt = bmapn(ip, off, n - tot, &blk);
+      breadn(blk, dst, cnt);
+      m = cnt << 9;
+      continue;
+    }
     // bp = bread(bmap(ip, off / BSIZE));
     // m = min((Uint) (n - tot), (Uint) (BSIZE - off % BSIZE));
     // memmove(dst, bp->data + off % BSIZE, m);
@@ -421,6 +445,8 @@ xvoff_t readi(struct inode *ip, char *dst, xvoff_t off, xvoff_t n) {
 xvoff_t writei(struct inode *ip, char *src, xvoff_t off, xvoff_t n) {
   xvoff_t tot, m;
   struct buf *bp;
+  xvblk_t blk;
+  Int cnt;
 
   if (off > ip->size || off + n < off)
     return -1;
@@ -428,6 +454,14 @@ xvoff_t writei(struct inode *ip, char *src, xvoff_t off, xvoff_t n) {
     return -1;
 
   for (tot = 0; tot < n; tot += m, off += m, src += m) {
+    // Write whole blocks which are together on the disk
+    // straight from src with one CH375 command
+    if ((off & (BSIZE-1)) == 0 && n - tot >= BSIZE) {
+      cnt = bmapn(ip, off, n - tot, &blk);
+      bwriten(blk, src, cnt);
+      m = cnt << 9;
+      continue;
+    }
     // bp = bread(bmap(ip, off / BSIZE));
     // m = min((Uint) (n - tot), (uint) (BSIZE - off % BSIZE));
     // memmove(bp->data + off % BSIZE, src, m);
@@ -47,6 +47,19 @@
 	.set CMD_DISK_WR_GO,   0x57
 	.set CMD_DISK_READY,   0x59
 
+; Status of Salmi's paravirtual disk, see blk.c
+	.set pvstatus,	0xfe97
+
+; Salmi's hypercall copy device: source, destination,
+; count and command, and the commands
+	.set hcsrc,	0xfea0
+	.set hcdst,	0xfea2
+	.set hccount,	0xfea4
+	.set hccmd,	0xfea6
+	.set HC_MEMCPY,	 1
+	.set HC_STRNCPY, 2
+	.set HC_STRLEN,	 3
+
 ; CH375 status results
 	.set USB_INT_SUCCESS,	 0x14
 	.set USB_INT_CONNECT,	 0x15
@@ -67,6 +80,7 @@
 ; Uninitialised variables
 	.bss
 chstatus:	.zero 1			; CH375 status after an FIRQ
+		.global chstatus
 uartflg:	.zero 1			; Flag indicating if char in uartch,
 					; initially zero (false)
 uartch:		.zero 1			; UART character available to read
@@ -211,6 +225,10 @@ prhexword:
 ; Initialise the CH375 device. Return D=1 if OK, D=0 on error.
 ch375init:
 	.global ch375init
+.ifdef PVDISK
+	ldd	#1			; The paravirtual disk needs no set up
+	rts
+.endif
 	lda	#CMD_RESET_ALL		; Do a reset
 	sta	chcmdwr
 
@@ -258,7 +276,18 @@ L7:	ldd	#0
 readblock:
 	.global readblock
 	tfr	D,X			; Get the buffer's start address
-	lda	#0xff
+	ldb	#1			; and read one block
+	bra	L7a
+
+; As for readblock, but with a 2-byte block count after the LBA on the
+; stack. Read that many blocks (1 to 255) starting at the LBA into the
+; buffer with one CH375 command.
+readblocks:
+	.global readblocks
+	tfr	D,X			; Get the buffer's start address
+	ldb	7,S			; and the number of blocks
+
+L7a:	lda	#0xff
 	sta	chstatus		; Store dummy value in chstatus
 	lda	#CMD_DISK_READ
 	sta	chcmdwr
@@ -270,8 +299,7 @@ readblock:
 	sta	chdatawr
 	lda	2,S
 	sta	chdatawr
-	lda	#1			; and read one block
-	sta	chdatawr
+	stb	chdatawr		; and the number of blocks
 
 L8:	lda	chstatus		; Get a real status after an interrupt
 	cmpa	#0xff
@@ -282,10 +310,7 @@ L8:	lda	chstatus		; Get a real status after an interrupt
 	lda	#CMD_RD_USB_DATA	; Now read the data
 	sta	chcmdwr
 	ldb	chdatard		; Get the buffer size
-L9:	lda	chdatard		; Read a data byte from the CH375
-	sta	,X+			; Store the byte in the buffer
-	decb
-	bne	L9			; Loop until the 64 bytes are read
+	jsr	romchunkrd		; and read the bytes into the buffer
 
 	lda	#0xff
 	sta	chstatus		; Store dummy value in chstatus
@@ -306,7 +331,18 @@ L11:	ldd	#1
 writeblock:
 	.global writeblock
 	tfr	D,X			; Get the buffer's start address
-	lda	#0xff
+	ldb	#1			; and write one block
+	bra	L11a
+
+; As for writeblock, but with a 2-byte block count after the LBA on the
+; stack. Write that many blocks (1 to 255) from the buffer starting at
+; the LBA with one CH375 command.
+writeblocks:
+	.global writeblocks
+	tfr	D,X			; Get the buffer's start address
+	ldb	7,S			; and the number of blocks
+
+L11a:	lda	#0xff
 	sta	chstatus		; Store dummy value in chstatus
 	lda	#CMD_DISK_WRITE
 	sta	chcmdwr
@@ -318,8 +354,7 @@ writeblock:
 	sta	chdatawr
 	lda	2,S
 	sta	chdatawr
-	lda	#1			; and write one block
-	sta	chdatawr
+	stb	chdatawr		; and the number of blocks
 
 L12:	lda	chstatus		; Get a real status after an interrupt
 	cmpa	#0xff
@@ -331,10 +366,7 @@ L12:	lda	chstatus		; Get a real status after an interrupt
 	sta	chcmdwr
 	ldb	#0x40			; 64 bytes at a time
 	stb	chdatawr		; Send the buffer size
-L13:	lda	,X+			; Read the byte from the buffer
-	sta	chdatawr		; and send to the CH375
-	decb
-	bne	L13			; Loop until all 64 bytes are sent
+	jsr	romchunkwr		; and send the bytes from the buffer
 
 	lda	#0xff
 	sta	chstatus		; Store dummy value in chstatus
@@ -427,6 +459,16 @@ jmptouser:
 
 rommemcpy:
 	.global rommemcpy
+.ifdef HYPERCOPY
+	std	hccount		; Get Salmi to do the copy
+	ldd	2,S
+	std	hcsrc
+	ldd	4,S
+	std	hcdst
+	lda	#HC_MEMCPY
+	sta	hccmd
+	rts
+.else
 	sta	disablerom	; Turn off the 24K of ROM
 	pshs	Y		; Save the Y register. Args now 4,S and 6,S.
 	ldx	4,S		; Get the source pointer
@@ -443,6 +485,7 @@ rommemcpy:
 	puls	Y		; Restore the Y register
 	sta	enablerom	; Turn on the 24K of ROM
 	rts
+.endif
 
 ; void romstrncpy(int count, void *src, void *dst)
 ; Copy no more than count bytes of string data from
@@ -450,6 +493,16 @@ rommemcpy:
 ; byte is copied. Ensure the dest buffer is NUL terminated.
 romstrncpy:
 	.global romstrncpy
+.ifdef HYPERCOPY
+	std	hccount		; Get Salmi to do the copy
+	ldd	2,S
+	std	hcsrc
+	ldd	4,S
+	std	hcdst
+	lda	#HC_STRNCPY
+	sta	hccmd
+	rts
+.else
 	sta	disablerom	; Turn off the 24K of ROM
 	pshs	Y		; Save the Y register. Args now 4,S and 6,S.
 	ldx	4,S		; Get the source pointer
@@ -469,11 +522,19 @@ romstrncpy:
 	puls	Y		; Restore the Y register
 	sta	enablerom	; Turn on the 24K of ROM
 	rts
+.endif
 
 ; int romstrlen(char *): count the length of a string
 ; which could be in userspace
 romstrlen:
 	.global romstrlen
+.ifdef HYPERCOPY
+	std	hcsrc		; Get Salmi to count the length
+	lda	#HC_STRLEN
+	sta	hccmd
+	ldd	hccount
+	rts
+.else
 	sta	disablerom	; Turn off the 24K of ROM
 	tfr	D,X		; Get the pointer into X
 	clra			; Set the count to zero
@@ -486,6 +547,33 @@ romstrlen:
 .2:
 	sta	enablerom	; Turn on the 24K of ROM
 	rts
+.endif
+
+; Read B bytes from the CH375 into the buffer at X, leaving X
+; just past them. The buffer could be in userspace under the
+; 24K of ROM, so this has to be here and not in the 24K ROM.
+romchunkrd:
+	sta	disablerom	; Turn off the 24K of ROM
+.1:
+	lda	chdatard	; Read a data byte from the CH375
+	sta	,X+		; Store the byte in the buffer
+	decb
+	bne	.1		; Loop until all the bytes are read
+	sta	enablerom	; Turn on the 24K of ROM
+	rts
+
+; Send B bytes from the buffer at X to the CH375,
+; leaving X just past them. As above, the buffer
+; could be in userspace under the 24K of ROM.
+romchunkwr:
+	sta	disablerom	; Turn off the 24K of ROM
+.1:
+	lda	,X+		; Read the byte from the buffer
+	sta	chdatawr	; and send to the CH375
+	decb
+	bne	.1		; Loop until all the bytes are sent
+	sta	enablerom	; Turn on the 24K of ROM
+	rts
 
 ; UART IRQ Handler
 
@@ -507,14 +595,20 @@ uartirq:
 ; When we get a fast IRQ, send CMD_GET_STATUS to the
 ; CH375 to stop the interrupt. Get the current status
 ; and store it in chstatus. Push/pop A to ensure it's intact.
+; With PVDISK, the FIRQ comes from Salmi's paravirtual
+; disk instead, and we store its status.
 ch375firq:
 	.global ch375firq
 	pshs	a
 	lda	#0		; Bring in the kernel data page zero
 	sta	pte0
+.ifdef PVDISK
+	lda	pvstatus	; Get the paravirtual disk's status
+.else
 	lda	#CMD_GET_STATUS
 	sta	chcmdwr
 	lda	chdatard	; Get the result back
+.endif
 	sta	chstatus
 	lda	frame0		; Retore the original page zero
 	sta	pte0